@@ -26,8 +26,12 @@
       }],
       ['OS=="linux"', {
         "sources": ["src/driver.cpp", "src/linux.cpp"],
+        "cflags": ["<!@(pkg-config --cflags atspi-2)"],
         "link_settings": {
-          "libraries": ["-lX11", "-lXtst"]
+          "libraries": [
+            "<!@(pkg-config --libs atspi-2)",
+            "-lX11", "-lX11-xcb", "-lxcb", "-lXfixes", "-lXi", "-lXtst"
+          ]
         }
       }]
     ]
@@ -21,7 +21,124 @@ const normalizeApplication = (s) => {
   return s.toLowerCase().replace(/ /g, "");
 };
 
-exports.click = (button, count) => {
+const listeners = { activeApplication: [], mouseMove: [], runningApplications: [] };
+let polling = [];
+let watched = { windows: false, mouse: false };
+let watching = { windows: false, mouse: false, mouseInterval: 0 };
+let windowValues = {};
+
+const fetchWindowValue = (change) => {
+  return change == "activeApplication"
+    ? exports.getActiveApplication()
+    : exports.getRunningApplications();
+};
+
+const notifyListeners = async (change, x, y) => {
+  if (change == "mouseMove") {
+    for (const callback of listeners.mouseMove.slice()) {
+      callback({ x, y });
+    }
+
+    return;
+  }
+
+  const value = await fetchWindowValue(change);
+  if (JSON.stringify(value) == JSON.stringify(windowValues[change])) {
+    return;
+  }
+
+  windowValues[change] = value;
+  for (const callback of listeners[change].slice()) {
+    callback(value);
+  }
+};
+
+const onWatchEvent = (change, x, y) => {
+  // the monitor can't follow the mouse (e.g., without XInput 2.1), or has lost its connection to
+  // the server entirely, so poll for whatever it can't tell us about instead
+  if (change == "mouseUnavailable") {
+    watched = { ...watched, mouse: false };
+    updatePolling();
+    return;
+  } else if (change == "lost") {
+    watched = { windows: false, mouse: false };
+    updatePolling();
+    return;
+  }
+
+  notifyListeners(change, x, y);
+};
+
+const updatePolling = () => {
+  polling.forEach((e) => clearInterval(e));
+  polling = [];
+
+  const { windows, mouse, mouseInterval } = watching;
+  if (windows && !watched.windows) {
+    polling.push(
+      setInterval(() => {
+        notifyListeners("activeApplication");
+        notifyListeners("runningApplications");
+      }, 500)
+    );
+  }
+
+  if (mouse && !watched.mouse) {
+    let last = {};
+    polling.push(
+      setInterval(async () => {
+        const location = await exports.getMouseLocation();
+        if (location.x != last.x || location.y != last.y) {
+          last = location;
+          notifyListeners("mouseMove", location.x, location.y);
+        }
+      }, Math.max(mouseInterval, 16))
+    );
+  }
+};
+
+const updateWatching = () => {
+  const windows = listeners.activeApplication.length > 0 || listeners.runningApplications.length > 0;
+  const mouse = listeners.mouseMove.length > 0;
+  const mouseInterval = mouse ? Math.min(...listeners.mouseMove.map((e) => e.interval)) : 0;
+
+  watching = { windows, mouse, mouseInterval };
+  if (!windows && !mouse) {
+    lib.unwatch();
+    watched = { windows: false, mouse: false };
+    updatePolling();
+    windowValues = {};
+    return;
+  }
+
+  // on Linux, we're told about changes as they happen, and the monitor is kept running while only
+  // what it listens for changes. elsewhere (or for mouse moves, without XInput 2.1), fall back to
+  // polling.
+  watched = lib.watch(onWatchEvent, watching);
+  updatePolling();
+};
+
+const subscribe = (change, callback, interval) => {
+  const listener = (value) => callback(value);
+  listener.interval = interval || 0;
+  listeners[change].push(listener);
+  updateWatching();
+
+  if (change != "mouseMove" && windowValues[change] === undefined) {
+    fetchWindowValue(change).then((value) => {
+      if (windowValues[change] === undefined) {
+        windowValues[change] = value;
+      }
+    });
+  }
+
+  return () => {
+    listeners[change] = listeners[change].filter((e) => e !== listener);
+    updateWatching();
+  };
+};
+
+exports.click = (button, count, options) => {
   if (!button) {
     button = "left";
   }
@@ -34,7 +151,7 @@ exports.click = (button, count) => {
     return;
   }
 
-  return lib.click(button, count);
+  return lib.click(button, count, options || {});
 };
 
 exports.clickButton = (button, count) => {
@@ -101,12 +218,16 @@ exports.getClickableButtons = () => {
   return lib.getClickableButtons();
 };
 
-exports.getEditorState = () => {
-  return lib.getEditorState();
+exports.getEditorState = (options) => {
+  return lib.getEditorState(options || {});
 };
 
-exports.getEditorStateFallback = (paragraph) => {
-  return lib.getEditorStateFallback(!!paragraph);
+exports.getEditorStateDelta = (sinceVersion) => {
+  return lib.getEditorStateDelta(sinceVersion || 0);
+};
+
+exports.getEditorStateFallback = (paragraph, options) => {
+  return lib.getEditorStateFallback(!!paragraph, options || {});
 };
 
 exports.getInstalledApplications = async () => {
@@ -165,6 +286,10 @@ exports.getRunningApplications = () => {
   return lib.getRunningApplications();
 };
 
+exports.getStats = () => {
+  return lib.getStats();
+};
+
 exports.launchApplication = async (application, aliases) => {
   if (os.platform() == "linux") {
     child_process.spawn(application, [], { detached: true });
@@ -210,23 +335,35 @@ exports.launchApplication = async (application, aliases) => {
   }
 };
 
-exports.mouseDown = (button) => {
+exports.mouseDown = (button, options) => {
   if (!button) {
     button = "left";
   }
 
-  return lib.mouseDown(button);
+  return lib.mouseDown(button, options || {});
 };
 
-exports.mouseUp = (button) => {
+exports.mouseUp = (button, options) => {
   if (!button) {
     button = "left";
   }
 
-  return lib.mouseUp(button);
+  return lib.mouseUp(button, options || {});
+};
+
+exports.onActiveApplicationChanged = (callback) => {
+  return subscribe("activeApplication", callback);
+};
+
+exports.onMouseMove = (callback, interval) => {
+  return subscribe("mouseMove", callback, interval);
 };
 
-exports.pressKey = (key, modifiers, count) => {
+exports.onRunningApplicationsChanged = (callback) => {
+  return subscribe("runningApplications", callback);
+};
+
+exports.pressKey = (key, modifiers, count, options) => {
   if (!modifiers) {
     modifiers = [];
   }
@@ -239,7 +376,7 @@ exports.pressKey = (key, modifiers, count) => {
     return;
   }
 
-  return lib.pressKey(key, modifiers, count);
+  return lib.pressKey(key, modifiers, count, options || {});
 };
 
 exports.quitApplication = async (application, aliases) => {
@@ -265,6 +402,10 @@ exports.quitApplication = async (application, aliases) => {
   return lib.pressKey(key, modifiers, 1);
 };
 
+exports.resetStats = () => {
+  return lib.resetStats();
+};
+
 exports.runShell = async (command, args, options) => {
   let stdout = "";
   let stderr = "";
@@ -289,6 +430,23 @@ exports.runShell = async (command, args, options) => {
   });
 };
 
+exports.sendInputBatch = (events, options) => {
+  if (!events || events.length == 0) {
+    return;
+  }
+
+  return lib.sendInputBatch(
+    events.map((e) => {
+      if ((e.type == "mouseDown" || e.type == "mouseUp") && !e.button) {
+        return { ...e, button: "left" };
+      }
+
+      return e;
+    }),
+    options || {}
+  );
+};
+
 exports.setEditorState = (text, cursor, cursorEnd) => {
   if (!cursorEnd) {
     cursorEnd = 0;
@@ -301,10 +459,18 @@ exports.setMouseLocation = (x, y) => {
   return lib.setMouseLocation(x, y);
 };
 
-exports.typeText = (text) => {
+exports.startTrace = () => {
+  return lib.startTrace();
+};
+
+exports.stopTrace = (path) => {
+  return lib.stopTrace(path);
+};
+
+exports.typeText = (text, options) => {
   if (!text) {
     return;
   }
 
-  return lib.typeText(text);
+  return lib.typeText(text, options || {});
 };
@@ -1,9 +1,19 @@
 #include <napi.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <tuple>
 #include <vector>
 
 #include "driver.hpp"
+#include "queue.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 #if __APPLE__
 
@@ -11,9 +21,6 @@
 
 #elif __linux__
 
-#include <X11/Xlib.h>
-#include <unistd.h>
-
 #include "linux.hpp"
 
 #else
@@ -34,222 +41,383 @@
   { statement; }
 #endif
 
+driver::Queue<Job*> jobs_;
+std::condition_variable jobsChanged_;
+std::mutex jobsMutex_;
+std::atomic<bool> mouseMovePending_(false);
+int pending_ = 0;
+Napi::ThreadSafeFunction resolver_;
+std::atomic<bool> sleeping_(false);
+std::atomic<bool> started_(false);
+std::atomic<bool> stopping_(false);
+Napi::ThreadSafeFunction watcher_;
+bool watching_ = false;
+std::thread worker_;
+
+std::vector<std::string> Characters(const std::string& text) {
+  // split UTF-8 text into characters by grouping each byte with the continuation bytes after it
+  std::vector<std::string> result;
+  size_t start = 0;
+  for (size_t i = 1; i <= text.length(); i++) {
+    if (i == text.length() || (static_cast<unsigned char>(text[i]) & 0xc0) != 0x80) {
+      result.push_back(text.substr(start, i - start));
+      start = i;
+    }
+  }
+
+  return result;
+}
+
 Napi::Promise Click(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
   std::string button = info[0].As<Napi::String>().Utf8Value();
   int count = info[1].As<Napi::Number>().Int32Value();
   if (count < 1) {
-    deferred.Resolve(env.Undefined());
-    return deferred.Promise();
+    return Resolved(env);
   }
 
-#ifdef __linux__
-  Display* display = XOpenDisplay(NULL);
-  driver::Click(display, button, count);
-  XCloseDisplay(display);
-#else
-  AUTORELEASE(driver::Click(button, count));
-#endif
-
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+  driver::Pacing pacing = GetPacing(info[2]);
+  return Run(env, "click", Paced(pacing, [=] { AUTORELEASE(driver::Click(button, count)); }));
 }
 
 Napi::Promise ClickButton(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
   int count = info[1].As<Napi::Number>().Int32Value();
   if (count < 1) {
-    deferred.Resolve(env.Undefined());
-    return deferred.Promise();
+    return Resolved(env);
   }
 
 #ifdef __APPLE__
-  AUTORELEASE(driver::ClickButton(info[0].As<Napi::String>().Utf8Value(), count));
+  std::string button = info[0].As<Napi::String>().Utf8Value();
+  return Run(env, "clickButton", [=] { AUTORELEASE(driver::ClickButton(button, count)); });
+#else
+  return Resolved(env);
 #endif
+}
 
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+#ifdef __APPLE__
+std::shared_ptr<const driver::KeyboardLayout> CurrentKeyboardLayout() {
+  // reading the layout has to happen on this thread, not the worker, so it's done as calls are made
+  std::shared_ptr<const driver::KeyboardLayout> result;
+  AUTORELEASE(result = driver::CurrentKeyboardLayout());
+  return result;
+}
+#endif
+
+Napi::Object EditorState(Napi::Env env, std::tuple<std::string, int, bool>& state, bool buffer) {
+  Napi::Object result = Napi::Object::New(env);
+  if (buffer) {
+    result.Set("text", ExternalBuffer(env, std::move(std::get<0>(state))));
+  } else {
+    result.Set("text", std::get<0>(state));
+  }
+
+  result.Set("cursor", std::get<1>(state));
+  result.Set("error", std::get<2>(state));
+  return result;
+}
+
+Napi::Value ExternalBuffer(Napi::Env env, std::string&& text) {
+  // the buffer points at the string's own storage, which is freed once javascript is done with it
+  std::string* data = new std::string(std::move(text));
+  napi_value result;
+  napi_status status = napi_create_external_buffer(
+      env, data->size(), &(*data)[0],
+      [](napi_env env, void* finalizeData, void* hint) { delete static_cast<std::string*>(hint); },
+      data, &result);
+  if (status == napi_ok) {
+    return Napi::Value(env, result);
+  }
+
+  // some runtimes (e.g., electron with the v8 sandbox) don't allow memory from outside the
+  // javascript heap, so those get a copy instead
+  Napi::Buffer<char> copy = Napi::Buffer<char>::Copy(env, data->data(), data->size());
+  delete data;
+  return copy;
 }
 
 Napi::Promise FocusApplication(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
-
-  AUTORELEASE(driver::FocusApplication(info[0].As<Napi::String>().Utf8Value()));
 
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+  std::string application = info[0].As<Napi::String>().Utf8Value();
+  return Run(env, "focusApplication", [=] { AUTORELEASE(driver::FocusApplication(application)); });
 }
 
 Napi::Promise GetActiveApplication(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
-
-  std::string ret;
-  AUTORELEASE(ret = driver::GetActiveApplication());
 
-  deferred.Resolve(Napi::String::New(env, ret));
-  return deferred.Promise();
+  std::shared_ptr<std::string> ret = std::make_shared<std::string>();
+  return Run(
+      env, "getActiveApplication", [=] { AUTORELEASE(*ret = driver::GetActiveApplication()); },
+      [=](Napi::Env env) { return Napi::String::New(env, *ret); });
 }
 
 Napi::Promise GetActiveApplicationWindowBounds(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
-  std::tuple<int, int, int, int> bounds;
-  AUTORELEASE(bounds = driver::GetActiveApplicationWindowBounds());
-  Napi::Object result = Napi::Object::New(env);
-  result.Set("x", std::get<0>(bounds));
-  result.Set("y", std::get<1>(bounds));
-  result.Set("height", std::get<2>(bounds));
-  result.Set("width", std::get<3>(bounds));
-  deferred.Resolve(result);
-  return deferred.Promise();
+  std::shared_ptr<std::tuple<int, int, int, int>> bounds =
+      std::make_shared<std::tuple<int, int, int, int>>();
+  return Run(
+      env, "getActiveApplicationWindowBounds",
+      [=] { AUTORELEASE(*bounds = driver::GetActiveApplicationWindowBounds()); },
+      [=](Napi::Env env) {
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("x", std::get<0>(*bounds));
+        result.Set("y", std::get<1>(*bounds));
+        result.Set("height", std::get<2>(*bounds));
+        result.Set("width", std::get<3>(*bounds));
+        return result;
+      });
 }
 
 Napi::Promise GetClickableButtons(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
+  std::shared_ptr<std::vector<std::string>> clickable =
+      std::make_shared<std::vector<std::string>>();
+  return Run(
+      env, "getClickableButtons",
+      [=] {
 #ifdef __APPLE__
-  std::vector<std::string> clickable;
-  AUTORELEASE(clickable = driver::GetClickableButtons());
-
-  Napi::Array result = Napi::Array::New(env, clickable.size());
-  for (size_t i = 0; i < clickable.size(); i++) {
-    result[i] = clickable[i];
-  }
-
-  deferred.Resolve(result);
-#else
-  Napi::Array result = Napi::Array::New(env, 0);
-  deferred.Resolve(result);
+        AUTORELEASE(*clickable = driver::GetClickableButtons());
 #endif
-
-  return deferred.Promise();
+      },
+      [=](Napi::Env env) {
+        Napi::Array result = Napi::Array::New(env, clickable->size());
+        for (size_t i = 0; i < clickable->size(); i++) {
+          result[i] = (*clickable)[i];
+        }
+
+        return result;
+      });
 }
 
 Napi::Promise GetEditorState(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
+  bool buffer =
+      info[0].IsObject() && info[0].As<Napi::Object>().Get("buffer").ToBoolean().Value();
+  std::shared_ptr<std::tuple<std::string, int, bool>> state =
+      std::make_shared<std::tuple<std::string, int, bool>>();
+  return Run(
+      env, "getEditorState", [=] { AUTORELEASE(*state = driver::GetEditorState()); },
+      [=](Napi::Env env) { return EditorState(env, *state, buffer); });
+}
+
+Napi::Promise GetEditorStateDelta(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  unsigned long sinceVersion = info[0].ToNumber().Int64Value();
 #ifdef __linux__
-  Display* display = XOpenDisplay(NULL);
-  std::tuple<std::string, int, bool> state = driver::GetEditorState(display);
-  XCloseDisplay(display);
+  std::shared_ptr<driver::EditorDelta> delta = std::make_shared<driver::EditorDelta>();
+  return Run(
+      env, "getEditorStateDelta", [=] { *delta = driver::GetEditorStateDelta(sinceVersion); },
+      [=](Napi::Env env) {
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("version", delta->version);
+        result.Set("cursor", delta->cursor);
+        result.Set("reset", delta->reset);
+        if (delta->reset) {
+          result.Set("text", delta->text);
+        }
+
+        Napi::Array changes = Napi::Array::New(env, delta->changes.size());
+        for (size_t i = 0; i < delta->changes.size(); i++) {
+          Napi::Object change = Napi::Object::New(env);
+          change.Set("start", delta->changes[i].start);
+          change.Set("end", delta->changes[i].end);
+          change.Set("text", delta->changes[i].text);
+          changes[i] = change;
+        }
+
+        result.Set("changes", changes);
+        result.Set("error", delta->error);
+        return result;
+      });
 #else
-  std::tuple<std::string, int, bool> state;
-  AUTORELEASE(state = driver::GetEditorState());
+  // without edit events to follow, every read starts over with the entire text
+  std::shared_ptr<std::tuple<std::string, int, bool>> state =
+      std::make_shared<std::tuple<std::string, int, bool>>();
+  return Run(
+      env, "getEditorStateDelta", [=] { AUTORELEASE(*state = driver::GetEditorState()); },
+      [=](Napi::Env env) {
+        Napi::Object result = EditorState(env, *state, false);
+        result.Set("version", sinceVersion + 1);
+        result.Set("reset", true);
+        result.Set("changes", Napi::Array::New(env));
+        return result;
+      });
 #endif
-
-  Napi::Object result = Napi::Object::New(env);
-  result.Set("text", std::get<0>(state));
-  result.Set("cursor", std::get<1>(state));
-  result.Set("error", std::get<2>(state));
-  deferred.Resolve(result);
-
-  return deferred.Promise();
 }
 
 Napi::Promise GetEditorStateFallback(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
   bool paragraph = info[0].As<Napi::Boolean>().Value();
-
+  bool buffer =
+      info[1].IsObject() && info[1].As<Napi::Object>().Get("buffer").ToBoolean().Value();
+  std::shared_ptr<std::tuple<std::string, int, bool>> state =
+      std::make_shared<std::tuple<std::string, int, bool>>();
 #ifdef __linux__
-  Display* display = XOpenDisplay(NULL);
-  std::tuple<std::string, int, bool> state = driver::GetEditorStateFallback(display, paragraph);
-  XCloseDisplay(display);
+  bool primary =
+      info[1].IsObject() && info[1].As<Napi::Object>().Get("primary").ToBoolean().Value();
+  return Run(
+      env, "getEditorStateFallback",
+      [=] { *state = driver::GetEditorStateFallback(paragraph, primary); },
+      [=](Napi::Env env) { return EditorState(env, *state, buffer); });
+#elif __APPLE__
+  std::shared_ptr<const driver::KeyboardLayout> layout = CurrentKeyboardLayout();
+  return Run(
+      env, "getEditorStateFallback",
+      [=] { AUTORELEASE(*state = driver::GetEditorStateFallback(*layout, paragraph)); },
+      [=](Napi::Env env) { return EditorState(env, *state, buffer); });
 #else
-  std::tuple<std::string, int, bool> state;
-  AUTORELEASE(state = driver::GetEditorStateFallback(paragraph));
+  return Run(
+      env, "getEditorStateFallback",
+      [=] { AUTORELEASE(*state = driver::GetEditorStateFallback(paragraph)); },
+      [=](Napi::Env env) { return EditorState(env, *state, buffer); });
 #endif
-
-  Napi::Object result = Napi::Object::New(env);
-  result.Set("text", std::get<0>(state));
-  result.Set("cursor", std::get<1>(state));
-  result.Set("error", std::get<2>(state));
-  deferred.Resolve(result);
-
-  return deferred.Promise();
 }
 
 Napi::Promise GetMouseLocation(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
-  std::tuple<int, int> location;
-  AUTORELEASE(location = driver::GetMouseLocation());
-  Napi::Object result = Napi::Object::New(env);
-  result.Set("x", std::get<0>(location));
-  result.Set("y", std::get<1>(location));
-  deferred.Resolve(result);
+#ifdef __linux__
+  // while the mouse is being watched, its location is kept up to date from raw motion, so it can be
+  // read without waiting for the worker, as long as there aren't any calls ahead of this one that
+  // could move it. warps by other clients aren't motion, so they're only seen on the next move.
+  std::tuple<int, int, bool> cached = driver::GetCachedMouseLocation();
+  if (std::get<2>(cached) && pending_ == 0) {
+    static driver::Histogram& stat = driver::Stat("getMouseLocation");
+    driver::Timer timer(stat);
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("x", std::get<0>(cached));
+    result.Set("y", std::get<1>(cached));
+    deferred.Resolve(result);
+    return deferred.Promise();
+  }
+#endif
 
-  return deferred.Promise();
+  std::shared_ptr<std::tuple<int, int>> location = std::make_shared<std::tuple<int, int>>();
+  return Run(
+      env, "getMouseLocation", [=] { AUTORELEASE(*location = driver::GetMouseLocation()); },
+      [=](Napi::Env env) {
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("x", std::get<0>(*location));
+        result.Set("y", std::get<1>(*location));
+        return result;
+      });
 }
 
-Napi::Promise GetRunningApplications(const Napi::CallbackInfo& info) {
-  Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+driver::Pacing GetPacing(const Napi::Value& options) {
+  driver::Pacing pacing;
+  if (!options.IsObject()) {
+    return pacing;
+  }
 
-  std::vector<std::string> running;
-  AUTORELEASE(running = driver::GetRunningApplications());
+  Napi::Object object = options.As<Napi::Object>();
+  Napi::Value mode = object.Get("pacing");
+  if (mode.IsString() && mode.As<Napi::String>().Utf8Value() == "sync") {
+    pacing.mode = driver::PacingMode::Sync;
+  }
 
-  Napi::Array result = Napi::Array::New(env, running.size());
-  for (size_t i = 0; i < running.size(); i++) {
-    result[i] = running[i];
+  Napi::Value syncInterval = object.Get("syncInterval");
+  if (syncInterval.IsNumber()) {
+    pacing.syncInterval = syncInterval.As<Napi::Number>().Int32Value();
   }
 
+  return pacing;
+}
+
+Napi::Promise GetStats(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  // everything is recorded with atomics, so it can be read right away rather than on the worker
+  Napi::Object histograms = Napi::Object::New(env);
+  driver::ForEachStat([&](const std::string& name, const driver::Histogram& histogram) {
+    Napi::Object summary = Napi::Object::New(env);
+    summary.Set("count", (double)histogram.Count());
+    summary.Set("mean", histogram.Mean() / 1000);
+    summary.Set("p50", histogram.Percentile(50) / 1000.0);
+    summary.Set("p90", histogram.Percentile(90) / 1000.0);
+    summary.Set("p99", histogram.Percentile(99) / 1000.0);
+    summary.Set("p999", histogram.Percentile(99.9) / 1000.0);
+    summary.Set("max", histogram.Max() / 1000.0);
+    histograms.Set(name, summary);
+  });
+
+  Napi::Object counters = Napi::Object::New(env);
+  for (const std::pair<std::string, uint64_t>& counter : driver::Counters()) {
+    counters.Set(counter.first, (double)counter.second);
+  }
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("latency", histograms);
+  result.Set("counters", counters);
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
   deferred.Resolve(result);
   return deferred.Promise();
 }
 
-Napi::Promise MouseDown(const Napi::CallbackInfo& info) {
+Napi::Promise GetRunningApplications(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
-#if __linux__
-  Display* display = XOpenDisplay(NULL);
-  driver::MouseDown(display, info[0].As<Napi::String>().Utf8Value());
-  XCloseDisplay(display);
-#else
-  AUTORELEASE(driver::MouseDown(info[0].As<Napi::String>().Utf8Value()));
-#endif
+  std::shared_ptr<std::vector<std::string>> running =
+      std::make_shared<std::vector<std::string>>();
+  return Run(
+      env, "getRunningApplications",
+      [=] { AUTORELEASE(*running = driver::GetRunningApplications()); },
+      [=](Napi::Env env) {
+        Napi::Array result = Napi::Array::New(env, running->size());
+        for (size_t i = 0; i < running->size(); i++) {
+          result[i] = (*running)[i];
+        }
+
+        return result;
+      });
+}
 
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+Napi::Promise MouseDown(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  std::string button = info[0].As<Napi::String>().Utf8Value();
+  driver::Pacing pacing = GetPacing(info[1]);
+  return Run(env, "mouseDown", Paced(pacing, [=] { AUTORELEASE(driver::MouseDown(button)); }));
 }
 
 Napi::Promise MouseUp(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
-#if __linux__
-  Display* display = XOpenDisplay(NULL);
-  driver::MouseUp(display, info[0].As<Napi::String>().Utf8Value());
-  XCloseDisplay(display);
+  std::string button = info[0].As<Napi::String>().Utf8Value();
+  driver::Pacing pacing = GetPacing(info[1]);
+  return Run(env, "mouseUp", Paced(pacing, [=] { AUTORELEASE(driver::MouseUp(button)); }));
+}
+
+std::function<void()> Paced(const driver::Pacing& pacing, const std::function<void()>& execute) {
+#ifdef __linux__
+  // pacing only applies to the call that asked for it, and since calls are run one at a time,
+  // setting it for the duration of the call is enough
+  return [=] {
+    driver::SetPacing(pacing);
+    execute();
+    driver::SetPacing(driver::Pacing());
+  };
 #else
-  AUTORELEASE(driver::MouseUp(info[0].As<Napi::String>().Utf8Value()));
+  return execute;
 #endif
-
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
 }
 
 Napi::Promise PressKey(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
+  std::string key = info[0].As<Napi::String>().Utf8Value();
   Napi::Array modifierArray = info[1].As<Napi::Array>();
   int count = info[2].As<Napi::Number>().Int32Value();
   if (count < 1) {
-    deferred.Resolve(env.Undefined());
-    return deferred.Promise();
+    return Resolved(env);
   }
 
   std::vector<std::string> modifiers;
@@ -258,79 +426,372 @@ Napi::Promise PressKey(const Napi::CallbackInfo& info) {
     modifiers.push_back(e.As<Napi::String>().Utf8Value());
   }
 
-#ifdef __linux__
-  Display* display = XOpenDisplay(NULL);
+  driver::Pacing pacing = GetPacing(info[3]);
+#ifdef __APPLE__
+  std::shared_ptr<const driver::KeyboardLayout> layout = CurrentKeyboardLayout();
+  return Run(env, "pressKey", Paced(pacing, [=] {
+               for (int i = 0; i < count; i++) {
+                 AUTORELEASE(driver::PressKey(*layout, key, modifiers));
+               }
+             }));
+#else
+  return Run(env, "pressKey", Paced(pacing, [=] {
+               for (int i = 0; i < count; i++) {
+                 AUTORELEASE(driver::PressKey(key, modifiers));
+               }
+             }));
 #endif
+}
 
-  for (int i = 0; i < count; i++) {
+Napi::Promise ResetStats(const Napi::CallbackInfo& info) {
+  driver::ResetStats();
+  return Resolved(info.Env());
+}
+
+void Resolve(Napi::Env env, Napi::Function callback, Job* job) {
+  // the environment is gone if we're being called while the resolver is torn down
+  if (env != nullptr) {
+    job->deferred.Resolve(job->resolve(env));
+    if (--pending_ == 0) {
+      resolver_.Unref(env);
+    }
+  }
+
+  delete job;
+}
+
+Napi::Promise Resolved(Napi::Env env) {
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+  deferred.Resolve(env.Undefined());
+  return deferred.Promise();
+}
+
+Napi::Promise Run(Napi::Env env, const char* name, std::function<void()> execute) {
+  return Run(env, name, execute, [](Napi::Env env) { return env.Undefined(); });
+}
+
+Napi::Promise Run(Napi::Env env, const char* name, std::function<void()> execute,
+                  std::function<Napi::Value(Napi::Env)> resolve) {
+  // each call is timed from when it's made, so time spent queued behind other calls counts too
+  Job* job = new Job{execute, resolve, Napi::Promise::Deferred::New(env), name,
+                     &driver::Stat(name), std::chrono::steady_clock::now()};
+  Napi::Promise promise = job->deferred.Promise();
+
+  // keep the event loop alive while there's work outstanding, but not while the worker is idle
+  if (pending_++ == 0) {
+    resolver_.Ref(env);
+  }
+
+  // submitting is wait-free unless the worker is parked, in which case it needs to be woken up
+  jobs_.Push(job);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(jobsMutex_);
+    jobsChanged_.notify_one();
+  }
+
+  return promise;
+}
+
+void RunJobs() {
+  while (!stopping_) {
+    Job* job = NULL;
+    if (!jobs_.Pop(job)) {
+      // announce that we're about to park before checking the queue one last time, so a job that's
+      // pushed concurrently either gets seen here or wakes us up
+      std::unique_lock<std::mutex> lock(jobsMutex_);
+      sleeping_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
 #ifdef __linux__
-    driver::PressKey(display, info[0].As<Napi::String>().Utf8Value(), modifiers);
-#else
-    AUTORELEASE(driver::PressKey(info[0].As<Napi::String>().Utf8Value(), modifiers));
+      // accessibility events keep arriving while there's nothing to do, so once we're listening for
+      // them, they're handled every so often rather than piling up on the bus until the next call
+      if (driver::AccessibilityInitialized()) {
+        bool woken =
+            jobsChanged_.wait_for(lock, std::chrono::seconds(1),
+                                  [] { return stopping_ || !jobs_.Empty(); });
+        sleeping_.store(false, std::memory_order_relaxed);
+        if (!woken) {
+          lock.unlock();
+          driver::ProcessAccessibilityEvents();
+        }
+
+        continue;
+      }
 #endif
+      jobsChanged_.wait(lock, [] { return stopping_ || !jobs_.Empty(); });
+      sleeping_.store(false, std::memory_order_relaxed);
+      continue;
+    }
+
+    {
+      driver::Span span(job->name);
+      job->execute();
+    }
+
+    job->stat->Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - job->submitted)
+                          .count());
+    if (resolver_.BlockingCall(job, Resolve) != napi_ok) {
+      delete job;
+    }
   }
 
 #ifdef __linux__
-  XCloseDisplay(display);
+  // the X connection belongs to this thread, so it's closed here rather than from the cleanup hook
+  driver::Shutdown();
 #endif
+}
 
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+Napi::Promise SendInputBatch(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  Napi::Array eventArray = info[0].As<Napi::Array>();
+  std::vector<driver::InputEvent> events;
+  for (uint32_t i = 0; i < eventArray.Length(); i++) {
+    Napi::Value e = eventArray[i];
+    Napi::Object o = e.As<Napi::Object>();
+    std::string type = o.Get("type").As<Napi::String>().Utf8Value();
+
+    driver::InputEvent event;
+    if (type == "keyDown" || type == "keyUp") {
+      event.type = type == "keyDown" ? driver::InputEventType::KeyDown
+                                     : driver::InputEventType::KeyUp;
+      event.key = o.Get("key").As<Napi::String>().Utf8Value();
+    } else if (type == "mouseDown" || type == "mouseUp") {
+      event.type = type == "mouseDown" ? driver::InputEventType::MouseDown
+                                       : driver::InputEventType::MouseUp;
+      event.button = o.Get("button").As<Napi::String>().Utf8Value();
+    } else if (type == "move") {
+      event.type = driver::InputEventType::Move;
+      event.x = o.Get("x").As<Napi::Number>().Int32Value();
+      event.y = o.Get("y").As<Napi::Number>().Int32Value();
+    } else if (type == "wait") {
+      event.type = driver::InputEventType::Wait;
+      event.delay = o.Get("delay").As<Napi::Number>().Int32Value();
+    } else {
+      continue;
+    }
+
+    events.push_back(event);
+  }
+
+  driver::Pacing pacing = GetPacing(info[1]);
+#ifdef __linux__
+  bool serverTiming =
+      info[1].IsObject() && info[1].As<Napi::Object>().Get("serverTiming").ToBoolean().Value();
+  std::shared_ptr<driver::TimingReport> report = std::make_shared<driver::TimingReport>();
+  return Run(
+      env, "sendInputBatch",
+      Paced(pacing, [=] { *report = driver::SendInputBatch(events, serverTiming); }),
+      [=](Napi::Env env) {
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("intended", report->intended);
+        result.Set("actual", report->actual);
+        result.Set("maxLateness", report->maxLateness);
+        return result;
+      });
+#elif __APPLE__
+  std::shared_ptr<const driver::KeyboardLayout> layout = CurrentKeyboardLayout();
+  return Run(env, "sendInputBatch",
+             Paced(pacing, [=] { AUTORELEASE(driver::SendInputBatch(*layout, events)); }));
+#else
+  return Run(env, "sendInputBatch",
+             Paced(pacing, [=] { AUTORELEASE(driver::SendInputBatch(events)); }));
+#endif
 }
 
 Napi::Promise SetEditorState(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
 #ifdef __APPLE__
-  AUTORELEASE(driver::SetEditorState(info[0].As<Napi::String>().Utf8Value(),
-                                     info[1].As<Napi::Number>().Int32Value(),
-                                     info[2].As<Napi::Number>().Int32Value()));
+  std::string text = info[0].As<Napi::String>().Utf8Value();
+  int cursor = info[1].As<Napi::Number>().Int32Value();
+  int cursorEnd = info[2].As<Napi::Number>().Int32Value();
+  return Run(env, "setEditorState",
+             [=] { AUTORELEASE(driver::SetEditorState(text, cursor, cursorEnd)); });
+#else
+  return Resolved(env);
 #endif
-
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
 }
 
 Napi::Promise SetMouseLocation(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
-  AUTORELEASE(driver::SetMouseLocation(info[0].As<Napi::Number>().Int32Value(),
-                                       info[1].As<Napi::Number>().Int32Value()));
+  int x = info[0].As<Napi::Number>().Int32Value();
+  int y = info[1].As<Napi::Number>().Int32Value();
+  return Run(env, "setMouseLocation", [=] { AUTORELEASE(driver::SetMouseLocation(x, y)); });
+}
 
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+Napi::Promise StartTrace(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  // tracing starts and stops in order with every other call, so a trace covers exactly the calls
+  // made between the two
+  return Run(env, "startTrace", [] { driver::StartTrace(); });
+}
+
+void StartWorker(Napi::Env env) {
+  stopping_ = false;
+  resolver_ = Napi::ThreadSafeFunction::New(
+      env, Napi::Function::New(env, [](const Napi::CallbackInfo& info) {}), "serenade-driver", 0,
+      1);
+  resolver_.Unref(env);
+  worker_ = std::thread(RunJobs);
+}
+
+void StopWatching(void* data) {
+  if (!watching_) {
+    return;
+  }
+
+#ifdef __linux__
+  driver::StopMonitor();
+#endif
+  watcher_.Release();
+  watching_ = false;
+  mouseMovePending_ = false;
+}
+
+Napi::Promise StopTrace(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  std::string path = info[0].As<Napi::String>().Utf8Value();
+  std::shared_ptr<bool> written = std::make_shared<bool>(false);
+  return Run(
+      env, "stopTrace", [=] { *written = driver::StopTrace(path); },
+      [=](Napi::Env env) { return Napi::Boolean::New(env, *written); });
+}
+
+void StopWorker(void* data) {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex_);
+    stopping_ = true;
+  }
+
+  jobsChanged_.notify_one();
+  worker_.join();
+
+  Job* job = NULL;
+  while (jobs_.Pop(job)) {
+    delete job;
+  }
+
+  resolver_.Release();
+  started_ = false;
 }
 
 Napi::Promise TypeText(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
 
   std::vector<std::string> modifiers;
   std::string text = info[0].As<Napi::String>().Utf8Value();
-
+  driver::Pacing pacing = GetPacing(info[1]);
 #ifdef __linux__
-  Display* display = XOpenDisplay(NULL);
+  if (info[1].IsObject() && info[1].As<Napi::Object>().Get("paste").ToBoolean().Value()) {
+    // if the clipboard can't be used, the text is typed like it would be otherwise
+    return Run(env, "typeText", [=] {
+      if (!driver::PasteText(text)) {
+        Paced(pacing, [=] {
+          for (const std::string& c : Characters(text)) {
+            driver::PressKey(c, modifiers);
+          }
+        })();
+      }
+    });
+  }
 #endif
 
-  for (char c : text) {
-#ifdef __linux__
-    driver::PressKey(display, std::string(1, c), modifiers);
+#ifdef __APPLE__
+  std::shared_ptr<const driver::KeyboardLayout> layout = CurrentKeyboardLayout();
+  return Run(env, "typeText", Paced(pacing, [=] {
+               for (const std::string& c : Characters(text)) {
+                 AUTORELEASE(driver::PressKey(*layout, c, modifiers));
+               }
+             }));
 #else
-    AUTORELEASE(driver::PressKey(std::string(1, c), modifiers));
+  return Run(env, "typeText", Paced(pacing, [=] {
+               for (const std::string& c : Characters(text)) {
+                 AUTORELEASE(driver::PressKey(c, modifiers));
+               }
+             }));
 #endif
-  }
+}
+
+Napi::Value Unwatch(const Napi::CallbackInfo& info) {
+  static driver::Histogram& stat = driver::Stat("unwatch");
+  driver::Timer timer(stat);
+  StopWatching(nullptr);
+  return info.Env().Undefined();
+}
+
+// returns which changes are watched natively. anything that isn't is left to js to poll for, as is
+// anything the callback is later told can't be watched after all ("mouseUnavailable"), or
+// everything, if the monitor loses its connection ("lost").
+Napi::Value Watch(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  static driver::Histogram& stat = driver::Stat("watch");
+  driver::Timer timer(stat);
+  Napi::Object result = Napi::Object::New(env);
 
 #ifdef __linux__
-  XCloseDisplay(display);
-#endif
+  // the callback is only told what changed. new window values are then fetched like any other call,
+  // so they're computed on the worker thread in order with everything else.
+  Napi::Object object = info[1].As<Napi::Object>();
+  driver::MonitorOptions options;
+  options.windows = object.Get("windows").ToBoolean().Value();
+  options.mouse = object.Get("mouse").ToBoolean().Value();
+  options.mouseInterval = object.Get("mouseInterval").ToNumber().Int32Value();
+
+  // changing what's watched keeps the monitor (and the callback it was first given), and only
+  // changes what it listens for
+  if (!watching_) {
+    watcher_ = Napi::ThreadSafeFunction::New(env, info[0].As<Napi::Function>(),
+                                             "serenade-driver-monitor", 0, 1);
+    watching_ = true;
+  }
 
-  deferred.Resolve(env.Undefined());
-  return deferred.Promise();
+  driver::StartMonitor(options, [](driver::MonitorEvent event) {
+    // only one move is queued at a time, since the callback reads the latest location anyway
+    if (event == driver::MonitorEvent::MouseMove && mouseMovePending_.exchange(true)) {
+      return;
+    }
+
+    watcher_.NonBlockingCall([event](Napi::Env env, Napi::Function callback) {
+      if (event == driver::MonitorEvent::MouseMove) {
+        mouseMovePending_ = false;
+        std::tuple<int, int, bool> location = driver::GetCachedMouseLocation();
+        callback.Call({Napi::String::New(env, "mouseMove"),
+                       Napi::Number::New(env, std::get<0>(location)),
+                       Napi::Number::New(env, std::get<1>(location))});
+      } else {
+        const char* name = event == driver::MonitorEvent::ActiveApplication ? "activeApplication"
+                           : event == driver::MonitorEvent::RunningApplications
+                               ? "runningApplications"
+                           : event == driver::MonitorEvent::MouseUnavailable ? "mouseUnavailable"
+                                                                            : "lost";
+        callback.Call({Napi::String::New(env, name)});
+      }
+    });
+  });
+
+  result.Set("windows", true);
+  result.Set("mouse", true);
+#else
+  result.Set("windows", false);
+  result.Set("mouse", false);
+#endif
+  return result;
 }
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
+  // the worker, its queue, and the watcher are shared by the whole process, so only one env (e.g.,
+  // the main thread, or a single worker thread) can use the module at a time
+  if (started_.exchange(true)) {
+    Napi::Error::New(env, "serenade-driver can only be loaded by one thread at a time")
+        .ThrowAsJavaScriptException();
+    return exports;
+  }
+
   exports.Set(Napi::String::New(env, "click"), Napi::Function::New(env, Click));
   exports.Set(Napi::String::New(env, "clickButton"), Napi::Function::New(env, ClickButton));
   exports.Set(Napi::String::New(env, "focusApplication"),
@@ -342,19 +803,34 @@ Napi::Object Init(Napi::Env env, Napi::Object exports) {
   exports.Set(Napi::String::New(env, "getClickableButtons"),
               Napi::Function::New(env, GetClickableButtons));
   exports.Set(Napi::String::New(env, "getEditorState"), Napi::Function::New(env, GetEditorState));
+  exports.Set(Napi::String::New(env, "getEditorStateDelta"),
+              Napi::Function::New(env, GetEditorStateDelta));
   exports.Set(Napi::String::New(env, "getEditorStateFallback"),
               Napi::Function::New(env, GetEditorStateFallback));
   exports.Set(Napi::String::New(env, "getMouseLocation"),
               Napi::Function::New(env, GetMouseLocation));
   exports.Set(Napi::String::New(env, "getRunningApplications"),
               Napi::Function::New(env, GetRunningApplications));
+  exports.Set(Napi::String::New(env, "getStats"), Napi::Function::New(env, GetStats));
   exports.Set(Napi::String::New(env, "pressKey"), Napi::Function::New(env, PressKey));
   exports.Set(Napi::String::New(env, "mouseDown"), Napi::Function::New(env, MouseDown));
   exports.Set(Napi::String::New(env, "mouseUp"), Napi::Function::New(env, MouseUp));
+  exports.Set(Napi::String::New(env, "resetStats"), Napi::Function::New(env, ResetStats));
+  exports.Set(Napi::String::New(env, "sendInputBatch"), Napi::Function::New(env, SendInputBatch));
   exports.Set(Napi::String::New(env, "setEditorState"), Napi::Function::New(env, SetEditorState));
   exports.Set(Napi::String::New(env, "setMouseLocation"),
               Napi::Function::New(env, SetMouseLocation));
+  exports.Set(Napi::String::New(env, "startTrace"), Napi::Function::New(env, StartTrace));
+  exports.Set(Napi::String::New(env, "stopTrace"), Napi::Function::New(env, StopTrace));
   exports.Set(Napi::String::New(env, "typeText"), Napi::Function::New(env, TypeText));
+  exports.Set(Napi::String::New(env, "unwatch"), Napi::Function::New(env, Unwatch));
+  exports.Set(Napi::String::New(env, "watch"), Napi::Function::New(env, Watch));
+
+  // system calls can block for a long time (e.g., typeText sleeps between every key), so they're
+  // all made from a single worker thread, in the order they were called
+  StartWorker(env);
+  napi_add_env_cleanup_hook(env, StopWorker, nullptr);
+  napi_add_env_cleanup_hook(env, StopWatching, nullptr);
 
   return exports;
 }
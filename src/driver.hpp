@@ -1,22 +1,70 @@
 #include <napi.h>
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
 #include <vector>
 
+namespace driver {
+class Histogram;
+struct KeyboardLayout;
+struct Pacing;
+}
+
+// a call into the driver: execute runs on the worker thread, then resolve builds the value that the
+// promise is resolved with back on the main thread. how long that took is recorded in stat, and
+// traced under name.
+struct Job {
+  std::function<void()> execute;
+  std::function<Napi::Value(Napi::Env)> resolve;
+  Napi::Promise::Deferred deferred;
+  const char* name;
+  driver::Histogram* stat;
+  std::chrono::steady_clock::time_point submitted;
+};
+
+std::vector<std::string> Characters(const std::string& text);
 Napi::Promise Click(const Napi::CallbackInfo& info);
 Napi::Promise ClickButton(const Napi::CallbackInfo& info);
+#ifdef __APPLE__
+std::shared_ptr<const driver::KeyboardLayout> CurrentKeyboardLayout();
+#endif
+Napi::Object EditorState(Napi::Env env, std::tuple<std::string, int, bool>& state, bool buffer);
+Napi::Value ExternalBuffer(Napi::Env env, std::string&& text);
 Napi::Promise FocusApplication(const Napi::CallbackInfo& info);
 Napi::Promise GetActiveApplication(const Napi::CallbackInfo& info);
 Napi::Promise GetActiveApplicationWindowBounds(const Napi::CallbackInfo& info);
 Napi::Promise GetClickableButtons(const Napi::CallbackInfo& info);
 Napi::Promise GetEditorState(const Napi::CallbackInfo& info);
+Napi::Promise GetEditorStateDelta(const Napi::CallbackInfo& info);
 Napi::Promise GetEditorStateFallback(const Napi::CallbackInfo& info);
 Napi::Promise GetMouseLocation(const Napi::CallbackInfo& info);
+driver::Pacing GetPacing(const Napi::Value& options);
 Napi::Promise GetRunningApplications(const Napi::CallbackInfo& info);
+Napi::Promise GetStats(const Napi::CallbackInfo& info);
 Napi::Promise MouseDown(const Napi::CallbackInfo& info);
 Napi::Promise MouseUp(const Napi::CallbackInfo& info);
+std::function<void()> Paced(const driver::Pacing& pacing, const std::function<void()>& execute);
 Napi::Promise PressKey(const Napi::CallbackInfo& info);
+Napi::Promise ResetStats(const Napi::CallbackInfo& info);
+void Resolve(Napi::Env env, Napi::Function callback, Job* job);
+Napi::Promise Resolved(Napi::Env env);
+Napi::Promise Run(Napi::Env env, const char* name, std::function<void()> execute);
+Napi::Promise Run(Napi::Env env, const char* name, std::function<void()> execute,
+                  std::function<Napi::Value(Napi::Env)> resolve);
+void RunJobs();
+Napi::Promise SendInputBatch(const Napi::CallbackInfo& info);
 Napi::Promise SetEditorState(const Napi::CallbackInfo& info);
 Napi::Promise SetMouseLocation(const Napi::CallbackInfo& info);
+Napi::Promise StartTrace(const Napi::CallbackInfo& info);
+void StartWorker(Napi::Env env);
+Napi::Promise StopTrace(const Napi::CallbackInfo& info);
+void StopWatching(void* data);
+void StopWorker(void* data);
 Napi::Promise TypeText(const Napi::CallbackInfo& info);
+Napi::Value Unwatch(const Napi::CallbackInfo& info);
+Napi::Value Watch(const Napi::CallbackInfo& info);
 
 Napi::Object Init(Napi::Env env, Napi::Object exports);
@@ -0,0 +1,28 @@
+#include <string>
+
+namespace driver {
+
+enum class InputEventType { KeyDown, KeyUp, MouseDown, MouseUp, Move, Wait };
+enum class PacingMode { Delay, Sync };
+
+// a single step of a batch passed to SendInputBatch. which fields are used depends on the type:
+// key for key events, button for mouse button events, x and y for moves, and delay (in
+// milliseconds) for waits.
+struct InputEvent {
+  InputEventType type = InputEventType::Wait;
+  std::string key;
+  std::string button;
+  int x = 0;
+  int y = 0;
+  int delay = 0;
+};
+
+// how input is slowed down so the receiving application doesn't drop events. with Delay, there's a
+// fixed sleep after each key or button; with Sync, we instead wait for the window server to process
+// everything sent so far, once every syncInterval keys or buttons.
+struct Pacing {
+  PacingMode mode = PacingMode::Delay;
+  int syncInterval = 1;
+};
+
+}  // namespace driver
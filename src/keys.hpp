@@ -0,0 +1,194 @@
+#include <cstdint>
+#include <string>
+
+#ifdef __linux__
+#include <X11/keysym.h>
+#endif
+
+namespace driver {
+
+// a named key and the code it corresponds to on the current platform: an X keysym on Linux, a
+// virtual keycode on macOS, and a virtual-key code on Windows. on macOS, flags is the event flag
+// the key sets when used as a modifier; on Windows, it's any extra flags needed when sending it.
+struct Key {
+  const char* name;
+  int code;
+  uint64_t flags;
+};
+
+// every platform's code for a key is listed together, so that adding or changing a key in one
+// place updates all of them. keys that don't exist on a platform use kNoCode.
+constexpr int kNoCode = -1;
+#if __APPLE__
+#define KEY(name, x11, mac, macFlags, win, winFlags) \
+  { name, mac, macFlags }
+#elif __linux__
+#define KEY(name, x11, mac, macFlags, win, winFlags) \
+  { name, x11, 0 }
+#else
+#define KEY(name, x11, mac, macFlags, win, winFlags) \
+  { name, win, winFlags }
+#endif
+
+constexpr Key kKeys[] = {
+    KEY("alt", XK_Alt_L, kVK_Option, kCGEventFlagMaskAlternate, VK_MENU, 0),
+    KEY("altgr", XK_ISO_Level3_Shift, kNoCode, 0, kNoCode, 0),
+    KEY("backspace", XK_BackSpace, kVK_Delete, 0, VK_BACK, 0),
+    KEY("caps", XK_Caps_Lock, kVK_CapsLock, 0, VK_CAPITAL, 0),
+    KEY("cmd", kNoCode, kVK_Command, kCGEventFlagMaskCommand, kNoCode, 0),
+    KEY("command", kNoCode, kVK_Command, kCGEventFlagMaskCommand, kNoCode, 0),
+    KEY("commandOrControl", XK_Control_L, kVK_Command, kCGEventFlagMaskCommand, VK_CONTROL, 0),
+    KEY("control", XK_Control_L, kVK_Control, kCGEventFlagMaskControl, VK_CONTROL, 0),
+    KEY("ctrl", XK_Control_L, kVK_Control, kCGEventFlagMaskControl, VK_CONTROL, 0),
+    KEY("delete", XK_Delete, kVK_Delete, 0, VK_DELETE, 0),
+    KEY("down", XK_Down, kVK_DownArrow, 0, VK_DOWN, 0),
+    KEY("end", XK_End, kVK_End, 0, VK_END, KEYEVENTF_EXTENDEDKEY),
+    KEY("enter", XK_Return, kVK_Return, 0, VK_RETURN, 0),
+    KEY("escape", XK_Escape, kVK_Escape, 0, VK_ESCAPE, 0),
+    KEY("f1", XK_F1, kVK_F1, 0, VK_F1, 0),
+    KEY("f2", XK_F2, kVK_F2, 0, VK_F2, 0),
+    KEY("f3", XK_F3, kVK_F3, 0, VK_F3, 0),
+    KEY("f4", XK_F4, kVK_F4, 0, VK_F4, 0),
+    KEY("f5", XK_F5, kVK_F5, 0, VK_F5, 0),
+    KEY("f6", XK_F6, kVK_F6, 0, VK_F6, 0),
+    KEY("f7", XK_F7, kVK_F7, 0, VK_F7, 0),
+    KEY("f8", XK_F8, kVK_F8, 0, VK_F8, 0),
+    KEY("f9", XK_F9, kVK_F9, 0, VK_F9, 0),
+    KEY("f10", XK_F10, kVK_F10, 0, VK_F10, 0),
+    KEY("f11", XK_F11, kVK_F11, 0, VK_F11, 0),
+    KEY("f12", XK_F12, kVK_F12, 0, VK_F12, 0),
+    KEY("fn", kNoCode, kVK_Function, kCGEventFlagMaskSecondaryFn, kNoCode, 0),
+    KEY("forwarddelete", XK_Delete, kVK_ForwardDelete, 0, VK_DELETE, 0),
+    KEY("function", kNoCode, kVK_Function, kCGEventFlagMaskSecondaryFn, kNoCode, 0),
+    KEY("home", XK_Home, kVK_Home, 0, VK_HOME, KEYEVENTF_EXTENDEDKEY),
+    KEY("left", XK_Left, kVK_LeftArrow, 0, VK_LEFT, 0),
+    KEY("meta", XK_Super_L, kNoCode, 0, VK_LWIN, 0),
+    KEY("option", XK_Alt_L, kVK_Option, kCGEventFlagMaskAlternate, VK_MENU, 0),
+    KEY("pagedown", XK_Next, kVK_PageDown, 0, VK_NEXT, 0),
+    KEY("pageup", XK_Prior, kVK_PageUp, 0, VK_PRIOR, 0),
+    KEY("return", XK_Return, kVK_Return, 0, VK_RETURN, 0),
+    KEY("right", XK_Right, kVK_RightArrow, 0, VK_RIGHT, 0),
+    KEY("shift", XK_Shift_L, kVK_Shift, kCGEventFlagMaskShift, VK_SHIFT, 0),
+    KEY("space", XK_space, kVK_Space, 0, VK_SPACE, 0),
+    KEY("tab", XK_Tab, kVK_Tab, 0, VK_TAB, 0),
+    KEY("up", XK_Up, kVK_UpArrow, 0, VK_UP, 0),
+    KEY("win", XK_Super_L, kNoCode, 0, VK_LWIN, 0),
+    KEY("windows", XK_Super_L, kNoCode, 0, VK_LWIN, 0),
+    KEY("\t", XK_Tab, kVK_Tab, 0, VK_TAB, 0),
+    KEY("\n", XK_Return, kVK_Return, 0, VK_RETURN, 0),
+    KEY(" ", XK_space, kVK_Space, 0, VK_SPACE, 0),
+};
+
+#undef KEY
+
+constexpr uint32_t kKeyCount = sizeof(kKeys) / sizeof(kKeys[0]);
+constexpr uint32_t kKeySlotCount = 1024;
+constexpr uint8_t kNoKey = 0xff;
+
+static_assert(kKeyCount < kNoKey, "too many keys to index with a byte");
+
+constexpr uint32_t HashKey(const char* s, size_t length, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ static_cast<unsigned char>(s[i])) * 16777619u;
+  }
+
+  return hash ^ (hash >> 15);
+}
+
+constexpr size_t KeyLength(const char* s) {
+  size_t length = 0;
+  while (s[length] != '\0') {
+    length++;
+  }
+
+  return length;
+}
+
+constexpr bool KeyNamesEqual(const char* a, const char* b) {
+  while (*a != '\0' && *a == *b) {
+    a++;
+    b++;
+  }
+
+  return *a == *b;
+}
+
+struct KeySlots {
+  uint32_t seed;
+  uint8_t slots[kKeySlotCount];
+};
+
+// try seeds until every key name hashes to a different slot, so that a lookup is a single hash and
+// a single string comparison. this runs at compile time.
+constexpr KeySlots LoadKeySlots() {
+  KeySlots result = {0, {}};
+  for (uint32_t seed = 0;; seed++) {
+    for (uint32_t i = 0; i < kKeySlotCount; i++) {
+      result.slots[i] = kNoKey;
+    }
+
+    bool collision = false;
+    for (uint32_t i = 0; i < kKeyCount && !collision; i++) {
+      uint32_t slot = HashKey(kKeys[i].name, KeyLength(kKeys[i].name), seed) % kKeySlotCount;
+      collision = result.slots[slot] != kNoKey;
+      result.slots[slot] = static_cast<uint8_t>(i);
+    }
+
+    if (!collision) {
+      result.seed = seed;
+      return result;
+    }
+  }
+}
+
+constexpr KeySlots kKeySlots = LoadKeySlots();
+
+constexpr uint8_t KeyIndex(const char* name, size_t length) {
+  uint8_t index = kKeySlots.slots[HashKey(name, length, kKeySlots.seed) % kKeySlotCount];
+  if (index == kNoKey || KeyLength(kKeys[index].name) != length) {
+    return kNoKey;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    if (kKeys[index].name[i] != name[i]) {
+      return kNoKey;
+    }
+  }
+
+  return index;
+}
+
+// returns the key with the given name, or NULL if it isn't a named key on this platform
+inline const Key* FindKey(const std::string& name) {
+  uint8_t index = KeyIndex(name.data(), name.length());
+  if (index == kNoKey || kKeys[index].code == kNoCode) {
+    return NULL;
+  }
+
+  return &kKeys[index];
+}
+
+// every key name must be unique, and must be found by a lookup of itself
+constexpr bool KeysAreValid() {
+  for (uint32_t i = 0; i < kKeyCount; i++) {
+    for (uint32_t j = i + 1; j < kKeyCount; j++) {
+      if (KeyNamesEqual(kKeys[i].name, kKeys[j].name)) {
+        return false;
+      }
+    }
+
+    if (KeyIndex(kKeys[i].name, KeyLength(kKeys[i].name)) != i) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static_assert(KeysAreValid(), "key names must be unique");
+static_assert(KeyIndex("shif", 4) == kNoKey && KeyIndex("shiftt", 6) == kNoKey &&
+                  KeyIndex("a", 1) == kNoKey,
+              "only exact key names should be found");
+
+}  // namespace driver
@@ -1,43 +1,501 @@
 #include <X11/XKBlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/Xfixes.h>
 #include <X11/extensions/XTest.h>
+#include <atspi/atspi.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <xcb/xcb.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <climits>
-#include <fstream>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <streambuf>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "keys.hpp"
 #include "linux.hpp"
+#include "probes.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
 namespace driver {
 
-void Click(Display* display, const std::string& button, int count) {
+// how long to wait for the clipboard owner to reply, and for an application to
+// copy its selection after being sent the copy chord, in milliseconds
+constexpr int kClipboardTimeout = 1000;
+constexpr int kCopyTimeout = 250;
+
+// how long to wait for an application to answer an accessibility request
+constexpr int kAccessibilityTimeout = 500;
+
+// how many edits to the tracked text field are kept, so that callers can catch
+// up on everything since the version they last saw
+constexpr size_t kEditorHistory = 1024;
+
+GMainContext* accessibilityContext_ = NULL;
+bool accessibilityInitialized_ = false;
+std::condition_variable clipboardChanged_;
+bool clipboardLost_ = false;
+std::mutex clipboardMutex_;
+bool clipboardOwned_ = false;
+int clipboardRequested_ = 0;
+int clipboardApplied_ = 0;
+Window clipboardPaster_ = None;
+std::string clipboardText_;
+Window clipboardWindow_ = 0;
+std::thread clipboardThread_;
+int clipboardTransfers_ = 0;
+int clipboardWake_[2] = {-1, -1};
+Atoms atoms_;
+Display* display_ = NULL;
+bool displayLost_ = false;
+AtspiAccessible* editorAccessible_ = NULL;
+unsigned long editorBaseVersion_ = 0;
+int editorCaret_ = 0;
+std::deque<std::pair<unsigned long, EditorChange>> editorChanges_;
+bool editorStale_ = true;
+std::string editorText_;
+unsigned long editorVersion_ = 0;
+AtspiAccessible* focusedAccessible_ = NULL;
+AtspiEventListener* focusListener_ = NULL;
+std::unordered_map<KeySym, std::tuple<int, bool, bool>> keycodes_;
+bool keycodesStale_ = true;
+std::function<void(MonitorEvent)> monitorCallback_;
+int monitorGeneration_ = 0;
+std::atomic<bool> monitorLost_(false);
+std::mutex monitorMutex_;
+MonitorOptions monitorOptions_;
+std::thread monitorThread_;
+int monitorWake_[2] = {-1, -1};
+std::atomic<uint64_t> mouseLocation_(0);
+std::atomic<bool> mouseLocationKnown_(false);
+std::vector<XFixesSelectionNotifyEvent> ownerChanges_;
+Pacing pacing_;
+int pacedEvents_ = 0;
+std::unordered_map<unsigned long, std::pair<unsigned long long, std::string>>
+    processPaths_;
+std::atomic<uint64_t>& procReads_ = Counter("procReads");
+std::atomic<uint64_t>& roundTrips_ = Counter("roundTrips");
+std::vector<std::string> runningApplications_;
+std::atomic<uint64_t>& sleepMicroseconds_ = Counter("sleepMicroseconds");
+Timeline timeline_;
+std::list<std::pair<int, KeySym>> spareKeycodes_;
+std::unordered_map<Window, std::string> windowNames_;
+std::vector<Window> windows_;
+AtspiEventListener* textListener_ = NULL;
+bool windowsStale_ = true;
+int xfixesEventBase_ = -1;
+int xkbEventBase_ = -1;
+
+bool AccessibilityInitialized() { return accessibilityInitialized_; }
+
+void AnswerSelectionRequest(Display* display, const Atoms& atoms,
+                            XSelectionRequestEvent& request,
+                            const std::string& text,
+                            std::vector<Transfer>& transfers) {
+  Atom targets = atoms.targets;
+  Atom utf8 = atoms.utf8String;
+  Atom textTarget = atoms.text;
+
+  XSelectionEvent reply = {};
+  reply.type = SelectionNotify;
+  reply.display = display;
+  reply.requestor = request.requestor;
+  reply.selection = request.selection;
+  reply.target = request.target;
+  reply.time = request.time;
+  reply.property = None;
+
+  // obsolete clients don't specify a property, and expect the target instead
+  Atom property = request.property == None ? request.target : request.property;
+  PROBE2(clipboard_answer, request.target, request.requestor);
+  // STRING is latin-1, so it's only offered when the text fits in it
+  std::string latin1;
+  bool latin1Supported = Utf8ToLatin1(text, latin1);
+  if (request.target == targets) {
+    Atom supported[] = {targets, utf8, textTarget, XA_STRING};
+    XChangeProperty(display, request.requestor, property, XA_ATOM, 32,
+                    PropModeReplace, (unsigned char*)supported,
+                    latin1Supported ? 4 : 3);
+    reply.property = property;
+  } else if (request.target == utf8 || request.target == textTarget ||
+             (request.target == XA_STRING && latin1Supported)) {
+    Atom type = request.target == XA_STRING ? XA_STRING : utf8;
+    const std::string& data = type == XA_STRING ? latin1 : text;
+    if (data.length() > SelectionChunkSize(display)) {
+      // too large to send in a single request, so tell the requestor how much
+      // is coming, then send it a chunk at a time as they delete the property
+      long length = data.length();
+      XSelectInput(display, request.requestor, PropertyChangeMask);
+      XChangeProperty(display, request.requestor, property, atoms.incr, 32,
+                      PropModeReplace, (unsigned char*)&length, 1);
+      transfers.push_back(Transfer{request.requestor, property, type, data, 0});
+    } else {
+      XChangeProperty(display, request.requestor, property, type, 8,
+                      PropModeReplace, (unsigned char*)data.data(),
+                      data.length());
+      CountTransfer(display, request.requestor);
+    }
+
+    reply.property = property;
+  }
+
+  XSendEvent(display, request.requestor, False, NoEventMask, (XEvent*)&reply);
+  XFlush(display);
+}
+
+void CacheMouseLocation(int x, int y) {
+  mouseLocation_.store(((uint64_t)(uint32_t)x << 32) | (uint32_t)y,
+                       std::memory_order_relaxed);
+}
+
+void Click(const std::string& button, int count) {
   for (int i = 0; i < count; i++) {
-    MouseDown(display, button);
-    MouseUp(display, button);
+    MouseDown(button);
+    MouseUp(button);
+  }
+}
+
+void CloseAccessibility() {
+  if (!accessibilityInitialized_) {
+    return;
+  }
+
+  if (focusedAccessible_ != NULL) {
+    g_object_unref(focusedAccessible_);
+    focusedAccessible_ = NULL;
+  }
+
+  if (editorAccessible_ != NULL) {
+    g_object_unref(editorAccessible_);
+    editorAccessible_ = NULL;
+  }
+
+  if (textListener_ != NULL) {
+    atspi_event_listener_deregister(textListener_, "object:text-changed",
+                                    NULL);
+    atspi_event_listener_deregister(textListener_, "object:text-caret-moved",
+                                    NULL);
+    g_object_unref(textListener_);
+    textListener_ = NULL;
+  }
+
+  atspi_event_listener_deregister(focusListener_,
+                                  "object:state-changed:focused", NULL);
+  g_object_unref(focusListener_);
+  focusListener_ = NULL;
+  atspi_exit();
+  g_main_context_unref(accessibilityContext_);
+  accessibilityContext_ = NULL;
+  accessibilityInitialized_ = false;
+  editorChanges_.clear();
+  editorStale_ = true;
+  editorText_.clear();
+}
+
+void CloseDisplay() {
+  if (display_ != NULL) {
+    // give back any keycodes we borrowed to type characters not in the layout
+    if (!displayLost_) {
+      KeySym none[2] = {NoSymbol, NoSymbol};
+      for (const std::pair<int, KeySym>& spare : spareKeycodes_) {
+        if (spare.second != NoSymbol) {
+          XChangeKeyboardMapping(display_, spare.first, 2, none, 1);
+        }
+      }
+    }
+
+    PROBE1(display_close, displayLost_);
+    XCloseDisplay(display_);
+    display_ = NULL;
+  }
+
+  atoms_ = Atoms();
+  displayLost_ = false;
+  keycodes_.clear();
+  keycodesStale_ = true;
+  runningApplications_.clear();
+  spareKeycodes_.clear();
+  windowNames_.clear();
+  windows_.clear();
+  windowsStale_ = true;
+  xfixesEventBase_ = -1;
+  xkbEventBase_ = -1;
+}
+
+long Codepoint(const std::string& s) {
+  if (s.empty()) {
+    return -1;
+  }
+
+  unsigned char lead = s[0];
+  size_t length = 1;
+  long result = lead;
+  if (lead >= 0xf0 && lead < 0xf8) {
+    length = 4;
+    result = lead & 0x07;
+  } else if (lead >= 0xe0) {
+    length = 3;
+    result = lead & 0x0f;
+  } else if (lead >= 0xc0) {
+    length = 2;
+    result = lead & 0x1f;
+  } else if (lead >= 0x80) {
+    return -1;
+  }
+
+  if (s.length() != length) {
+    return -1;
+  }
+
+  for (size_t i = 1; i < length; i++) {
+    unsigned char c = s[i];
+    if ((c & 0xc0) != 0x80) {
+      return -1;
+    }
+
+    result = (result << 6) | (c & 0x3f);
+  }
+
+  return result;
+}
+
+void ContinueTransfer(Display* display, XPropertyEvent& event,
+                      std::vector<Transfer>& transfers) {
+  if (event.state != PropertyDelete) {
+    return;
+  }
+
+  for (std::vector<Transfer>::iterator transfer = transfers.begin();
+       transfer != transfers.end(); transfer++) {
+    if (transfer->requestor != event.window ||
+        transfer->property != event.atom) {
+      continue;
+    }
+
+    // the requestor deleted the last chunk, so send the next one. once
+    // everything has been sent, an empty chunk marks the end of the transfer.
+    size_t length = std::min(transfer->data.length() - transfer->offset,
+                             SelectionChunkSize(display));
+    XChangeProperty(display, transfer->requestor, transfer->property,
+                    transfer->type, 8, PropModeReplace,
+                    (unsigned char*)transfer->data.data() + transfer->offset,
+                    length);
+    transfer->offset += length;
+    if (length == 0) {
+      XSelectInput(display, transfer->requestor, NoEventMask);
+      CountTransfer(display, transfer->requestor);
+      transfers.erase(transfer);
+    }
+
+    XFlush(display);
+    return;
+  }
+}
+
+bool ConvertSelection(Display* display, Window window, Atom selection,
+                      Atom target, std::string& result, Atom& type,
+                      int& format) {
+  timespec deadline = Deadline(kClipboardTimeout);
+  XConvertSelection(display, selection, target, atoms_.xselData, window,
+                    CurrentTime);
+  PROBE2(clipboard_request, selection, target);
+
+  // wait for the owner to reply, but not forever, since it might never do so
+  XEvent event;
+  while (true) {
+    if (!NextEvent(display, event, deadline)) {
+      return false;
+    }
+
+    if (event.type == SelectionNotify &&
+        event.xselection.selection == selection &&
+        event.xselection.requestor == window) {
+      break;
+    }
+
+    ProcessEvent(display, event);
+  }
+
+  PROBE2(clipboard_response, target, event.xselection.property != None);
+  if (event.xselection.property == None) {
+    return false;
   }
+
+  // deleting the property is what tells the owner we're ready for more
+  result.clear();
+  ReadProperty(display, window, atoms_.xselData, result, type, format);
+  if (type != atoms_.incr) {
+    return true;
+  }
+
+  // the owner is sending the data a chunk at a time. the property holds a lower
+  // bound on the total size, so the buffer only needs to grow if it's exceeded.
+  long size = result.length() >= sizeof(long) ? *(const long*)result.data() : 0;
+  result.clear();
+  result.reserve(std::max(size, 0L));
+  std::string chunk;
+  while (true) {
+    deadline = Deadline(kClipboardTimeout);
+    while (true) {
+      if (!NextEvent(display, event, deadline)) {
+        return false;
+      }
+
+      if (event.type == PropertyNotify && event.xproperty.window == window &&
+          event.xproperty.atom == atoms_.xselData &&
+          event.xproperty.state == PropertyNewValue) {
+        break;
+      }
+
+      ProcessEvent(display, event);
+    }
+
+    chunk.clear();
+    ReadProperty(display, window, atoms_.xselData, chunk, type, format);
+    if (chunk.empty()) {
+      return true;
+    }
+
+    result.append(chunk);
+  }
+}
+
+std::string CopySelection(Display* display, Window window) {
+  if (xfixesEventBase_ == -1) {
+    PressKey("c", std::vector<std::string>{"control"});
+    timeline_.Wait(10000);
+    return GetClipboard(display, window);
+  }
+
+  // empty the clipboard first, so that if nothing is copied (e.g., because
+  // nothing is selected), we don't read whatever was there before
+  if (!SetClipboard("", true)) {
+    return "";
+  }
+
+  Window ours = 0;
+  {
+    std::lock_guard<std::mutex> lock(clipboardMutex_);
+    ours = clipboardWindow_;
+  }
+
+  // rather than guessing how long the application will take, wait until it
+  // takes the clipboard from us
+  ownerChanges_.clear();
+  XFixesSelectSelectionInput(display, window, atoms_.clipboard,
+                             XFixesSetSelectionOwnerNotifyMask);
+  PressKey("c", std::vector<std::string>{"control"});
+  bool copied = WaitForOwner(
+      display, atoms_.clipboard, [=](const XFixesSelectionNotifyEvent& change) {
+        return change.owner != None && change.owner != ours;
+      });
+
+  XFixesSelectSelectionInput(display, window, atoms_.clipboard, 0);
+  ownerChanges_.clear();
+  return copied ? GetClipboard(display, window) : "";
+}
+
+void CountTransfer(Display* display, Window requestor) {
+  // clipboard managers fetch the text as soon as we take ownership, so only a
+  // transfer to the application being pasted into counts. windows created by
+  // the same client share the bits outside this mask.
+  uint32_t mask = xcb_get_setup(XGetXCBConnection(display))->resource_id_mask;
+  std::lock_guard<std::mutex> lock(clipboardMutex_);
+  if (clipboardPaster_ != None &&
+      (requestor & ~mask) == (clipboardPaster_ & ~mask)) {
+    clipboardTransfers_++;
+    clipboardChanged_.notify_all();
+  }
+}
+
+timespec Deadline(int timeout) {
+  timespec result;
+  clock_gettime(CLOCK_MONOTONIC, &result);
+  result.tv_sec += timeout / 1000;
+  result.tv_nsec += (timeout % 1000) * 1000000L;
+  result.tv_sec += result.tv_nsec / 1000000000;
+  result.tv_nsec %= 1000000000;
+  return result;
+}
+
+long Elapsed(const timespec& from, const timespec& to) {
+  return (to.tv_sec - from.tv_sec) * 1000000 +
+         (to.tv_nsec - from.tv_nsec) / 1000;
+}
+
+AtspiAccessible* FindFocusedAccessible(AtspiAccessible* accessible,
+                                       int depth) {
+  AtspiStateSet* states = atspi_accessible_get_state_set(accessible);
+  bool focused = atspi_state_set_contains(states, ATSPI_STATE_FOCUSED);
+  bool showing = atspi_state_set_contains(states, ATSPI_STATE_SHOWING);
+  g_object_unref(states);
+  if (focused) {
+    return (AtspiAccessible*)g_object_ref(accessible);
+  }
+
+  // every child is a round trip to the application, so skip anything that
+  // isn't on screen, and don't wander into huge lists or deep trees
+  if ((!showing && depth > 0) || depth > 32) {
+    return NULL;
+  }
+
+  int count = atspi_accessible_get_child_count(accessible, NULL);
+  for (int i = 0; i < std::min(count, 512); i++) {
+    AtspiAccessible* child =
+        atspi_accessible_get_child_at_index(accessible, i, NULL);
+    if (child == NULL) {
+      continue;
+    }
+
+    AtspiAccessible* result = FindFocusedAccessible(child, depth + 1);
+    g_object_unref(child);
+    if (result != NULL) {
+      return result;
+    }
+  }
+
+  return NULL;
 }
 
 void FocusApplication(const std::string& application) {
-  Display* display = XOpenDisplay(NULL);
-  std::vector<Window> windows = GetAllWindows(display);
-  for (Window window : windows) {
-    std::string name = ProcessName(display, window);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return;
+  }
+
+  ProcessEvents(display);
+  UpdateWindows(display);
+  for (Window window : windows_) {
+    std::string name = windowNames_[window];
     if (name.find(application) != std::string::npos) {
       XClientMessageEvent event;
       event.type = ClientMessage;
       event.display = display;
       event.window = window;
-      event.message_type =
-          XInternAtom(display, std::string("_NET_ACTIVE_WINDOW").c_str(), 1);
+      event.message_type = atoms_.netActiveWindow;
       event.format = 32;
       event.data.l[0] = 1;
       event.data.l[1] = CurrentTime;
@@ -53,12 +511,14 @@ void FocusApplication(const std::string& application) {
       break;
     }
   }
-
-  XCloseDisplay(display);
 }
 
 std::string GetActiveApplication() {
-  Display* display = XOpenDisplay(NULL);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return "";
+  }
+
   Window root = XDefaultRootWindow(display);
   if (root == 0) {
     return "";
@@ -66,22 +526,31 @@ std::string GetActiveApplication() {
 
   unsigned long length = 0;
   unsigned char* property = 0;
-  GetProperty(display, root, "_NET_ACTIVE_WINDOW", &property, &length);
+  GetProperty(display, root, atoms_.netActiveWindow, &property, &length);
   if (property == 0) {
     return "";
   }
 
   Window* window = (Window*)property;
-  std::string result = ProcessName(display, *window);
+  ProcessEvents(display);
+  UpdateWindows(display);
+  std::unordered_map<Window, std::string>::iterator cached =
+      windowNames_.find(*window);
+  std::string result = cached != windowNames_.end()
+                           ? cached->second
+                           : ProcessName(display, *window);
 
   XFree(window);
-  XCloseDisplay(display);
   return result;
 }
 
 std::tuple<int, int, int, int> GetActiveApplicationWindowBounds() {
   std::tuple<int, int, int, int> result;
-  Display* display = XOpenDisplay(NULL);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return result;
+  }
+
   Window root = XDefaultRootWindow(display);
   if (root == 0) {
     return result;
@@ -89,23 +558,25 @@ std::tuple<int, int, int, int> GetActiveApplicationWindowBounds() {
 
   unsigned long length = 0;
   unsigned char* property = 0;
-  GetProperty(display, root, "_NET_ACTIVE_WINDOW", &property, &length);
+  GetProperty(display, root, atoms_.netActiveWindow, &property, &length);
   if (property == 0) {
     return result;
   }
 
   Window* window = (Window*)property;
   if (*window == 0) {
+    XFree(window);
     return result;
   }
+  // xlib gets the window's attributes and its geometry with separate requests
   XWindowAttributes attrs;
+  roundTrips_.fetch_add(2, std::memory_order_relaxed);
   XGetWindowAttributes(display, *window, &attrs);
   std::get<0>(result) = attrs.x;
   std::get<1>(result) = attrs.y;
   std::get<2>(result) = attrs.height;
   std::get<3>(result) = attrs.width;
   XFree(window);
-  XCloseDisplay(display);
   return result;
 }
 
@@ -117,7 +588,7 @@ std::vector<Window> GetAllWindows(Display* display) {
   }
   unsigned long length = 0;
   unsigned char* property = 0;
-  GetProperty(display, root, "_NET_CLIENT_LIST", &property, &length);
+  GetProperty(display, root, atoms_.netClientList, &property, &length);
   if (property == 0) {
     return result;
   }
@@ -131,250 +602,289 @@ std::vector<Window> GetAllWindows(Display* display) {
   return result;
 }
 
+std::tuple<int, int, bool> GetCachedMouseLocation() {
+  std::tuple<int, int, bool> result;
+  uint64_t location = mouseLocation_.load(std::memory_order_relaxed);
+  std::get<0>(result) = (int32_t)(location >> 32);
+  std::get<1>(result) = (int32_t)(location & 0xffffffff);
+  std::get<2>(result) = mouseLocationKnown_.load(std::memory_order_relaxed);
+  return result;
+}
+
 std::string GetClipboard(Display* display, Window window) {
-  if (window == 0) {
-    return "";
+  static Histogram& stat = Stat("driver::GetClipboard");
+  Timer timer(stat);
+  return GetSelection(display, window, atoms_.clipboard);
+}
+
+Display* GetDisplay() {
+  if (display_ != NULL && !displayLost_) {
+    return display_;
   }
 
-  Atom buffer = XInternAtom(display, "CLIPBOARD", False);
-  Atom format = XInternAtom(display, "STRING", False);
-  Atom property = XInternAtom(display, "XSEL_DATA", False);
-  Atom incr = XInternAtom(display, "INCR", False);
+  Span span("GetDisplay");
 
-  std::string result = "";
-  char* data = NULL;
-  int dataBits = 0;
-  unsigned long dataSize = 0;
-  unsigned long dataTail = 0;
-  XEvent event;
-  XConvertSelection(display, buffer, format, property, window, CurrentTime);
-  do {
-    XNextEvent(display, &event);
-  } while (event.type != SelectionNotify ||
-           event.xselection.selection != buffer);
+  // the connection is shared by every call for the lifetime of the process, so
+  // a protocol error (e.g., a window that was destroyed while we were querying
+  // it) shouldn't exit, and losing the server should only mean reconnecting.
+  CloseDisplay();
+  XSetErrorHandler(OnError);
+  display_ = OpenDisplay();
+  if (display_ == NULL) {
+    return display_;
+  }
+
+  PROBE1(display_open, ConnectionNumber(display_));
+
+  XSetIOErrorExitHandler(display_, OnIOError, NULL);
+  atoms_ = InternAtoms(display_);
+
+  // the keycode table only needs to be rebuilt when the layout changes, which
+  // the server tells us about with these events
+  int opcode = 0;
+  int errorBase = 0;
+  int major = XkbMajorVersion;
+  int minor = XkbMinorVersion;
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (XkbQueryExtension(display_, &opcode, &xkbEventBase_, &errorBase, &major,
+                        &minor)) {
+    // finding the extension is one request, and agreeing on a version another
+    roundTrips_.fetch_add(1, std::memory_order_relaxed);
+    XkbSelectEvents(display_, XkbUseCoreKbd, XkbNewKeyboardNotifyMask,
+                    XkbNewKeyboardNotifyMask);
+    XkbSelectEventDetails(display_, XkbUseCoreKbd, XkbStateNotify,
+                          XkbGroupStateMask, XkbGroupStateMask);
+  } else {
+    xkbEventBase_ = -1;
+  }
+
+  // xfixes tells us when the clipboard changes hands, so we know when an
+  // application has finished copying
+  int xfixesErrorBase = 0;
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (!XFixesQueryExtension(display_, &xfixesEventBase_, &xfixesErrorBase)) {
+    xfixesEventBase_ = -1;
+  } else {
+    roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // likewise, the window list is cached until the window manager changes it
+  XSelectInput(display_, XDefaultRootWindow(display_), PropertyChangeMask);
+
+  return display_;
+}
+
+std::tuple<std::string, int, bool> GetEditorState() {
+  std::tuple<std::string, int, bool> result;
+  std::get<2>(result) = true;
+
+  Display* display = GetDisplay();
+  if (display == NULL || !InitializeAccessibility()) {
+    return result;
+  }
+
+  AtspiAccessible* accessible = GetFocusedAccessible(display);
+  std::string text;
+  int caret = 0;
+  if (accessible == NULL || !ReadAccessibleText(accessible, text, caret)) {
+    return result;
+  }
+
+  // at-spi counts characters, but the cursor is an index into a javascript
+  // string, which counts utf-16 code units
+  std::get<1>(result) = Utf16Offset(text, caret);
+  std::get<0>(result) = std::move(text);
+  std::get<2>(result) = false;
+  return result;
+}
+
+EditorDelta GetEditorStateDelta(unsigned long sinceVersion) {
+  EditorDelta result;
+  Display* display = GetDisplay();
+  if (display == NULL || !InitializeAccessibility()) {
+    return result;
+  }
 
-  if (event.xselection.property) {
-    XGetWindowProperty(display, window, property, 0, LONG_MAX / 4, False,
-                       AnyPropertyType, &format, &dataBits, &dataSize,
-                       &dataTail, (unsigned char**)&data);
+  // edits are only reported to us once we ask for them, so the first call
+  // starts listening, and every call after that only has to catch up
+  if (textListener_ == NULL) {
+    textListener_ = atspi_event_listener_new_simple(OnTextEvent, NULL);
+    atspi_event_listener_register(textListener_, "object:text-changed", NULL);
+    atspi_event_listener_register(textListener_, "object:text-caret-moved",
+                                  NULL);
+  }
+
+  AtspiAccessible* accessible = GetFocusedAccessible(display);
+  if (accessible == NULL) {
+    return result;
+  }
 
-    if (data != NULL && format != incr) {
-      result = std::string(data);
+  // an edit made between reading the text and listening for edits would be
+  // applied twice, and an edit we missed not at all, so compare lengths with
+  // the application to catch either one. that's a single, small round trip.
+  bool stale = editorStale_ || accessible != editorAccessible_;
+  if (!stale) {
+    AtspiText* text = atspi_accessible_get_text_iface(accessible);
+    long characters = text == NULL ? -1
+                                   : atspi_text_get_character_count(text, NULL);
+    stale = characters != std::count_if(
+                              editorText_.begin(), editorText_.end(),
+                              [](char c) { return (c & 0xc0) != 0x80; });
+    if (text != NULL) {
+      g_object_unref(text);
     }
+  }
+
+  if (stale && !TrackEditor(accessible)) {
+    return result;
+  }
 
-    if (data != NULL) {
-      XFree(data);
+  result.version = editorVersion_;
+  result.cursor = Utf16Offset(editorText_, editorCaret_);
+  result.error = false;
+  if (sinceVersion < editorBaseVersion_ || sinceVersion > editorVersion_) {
+    result.reset = true;
+    result.text = editorText_;
+    return result;
+  }
+
+  for (const std::pair<unsigned long, EditorChange>& change : editorChanges_) {
+    if (change.first > sinceVersion) {
+      result.changes.push_back(change.second);
     }
   }
 
   return result;
 }
 
-std::tuple<std::string, int, bool> GetEditorState(Display* display) {
+std::tuple<std::string, int, bool> GetEditorStateFallback(bool paragraph,
+                                                          bool primary) {
   std::tuple<std::string, int, bool> result;
   std::get<2>(result) = true;
-  return result;
-}
 
-std::tuple<std::string, int, bool> GetEditorStateFallback(Display* display,
-                                                          bool paragraph) {
-  std::tuple<std::string, int, bool> result;
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return result;
+  }
 
   unsigned long color = BlackPixel(display, DefaultScreen(display));
   Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0,
                                       1, 1, 0, color, color);
+  std::string previous = primary ? "" : GetClipboard(display, window);
+
+  // selecting text makes it the primary selection, so reading that skips the
+  // copy chord, and leaves the clipboard alone
+  timeline_.Reset();
+  std::vector<std::string> select = {"control", "shift"};
+  std::string left;
+  if (primary) {
+    left = ReadPrimary(display, window, paragraph ? "up" : "home", select);
+  } else {
+    PressKey(paragraph ? "up" : "home", select);
+    left = CopySelection(display, window);
+  }
+  PressKey("right", std::vector<std::string>{});
+
+  std::string right;
+  if (primary) {
+    right = ReadPrimary(display, window, paragraph ? "down" : "end", select);
+  } else {
+    PressKey(paragraph ? "down" : "end", select);
+    right = CopySelection(display, window);
+  }
+  PressKey("left", std::vector<std::string>{});
 
-  PressKey(display, paragraph ? "up" : "home",
-           std::vector<std::string>{"control", "shift"});
-  PressKey(display, "c", std::vector<std::string>{"control"});
-  usleep(10000);
-  PressKey(display, "right", std::vector<std::string>{});
-  std::string left = GetClipboard(display, window);
-
-  PressKey(display, paragraph ? "down" : "end",
-           std::vector<std::string>{"control", "shift"});
-  PressKey(display, "c", std::vector<std::string>{"control"});
-  usleep(10000);
-  PressKey(display, "left", std::vector<std::string>{});
-  std::string right = GetClipboard(display, window);
+  // put back whatever the user had copied before we started
+  if (!primary) {
+    SetClipboard(previous, previous != "");
+  }
 
+  // the cursor is reported in utf-16 code units, like the accessibility path.
+  // there are never more characters than bytes, so this counts all of left.
   std::get<0>(result) = left + right;
-  std::get<1>(result) = left.length();
+  std::get<1>(result) = Utf16Offset(left, left.length());
   std::get<2>(result) = false;
+  XDestroyWindow(display, window);
   return result;
 }
 
+AtspiAccessible* GetFocusedAccessible(Display* display) {
+  // events queue up on the bus between calls, so handling them here keeps the
+  // cached accessible current without walking the tree each time
+  ProcessAccessibilityEvents();
+
+  if (focusedAccessible_ != NULL) {
+    return focusedAccessible_;
+  }
+
+  unsigned long length = 0;
+  unsigned char* property = 0;
+  GetProperty(display, XDefaultRootWindow(display), atoms_.netActiveWindow,
+              &property, &length);
+  if (property == 0) {
+    return NULL;
+  }
+
+  unsigned long pid = GetWindowPids(display, {*(Window*)property})[0];
+  XFree(property);
+  AtspiAccessible* desktop = atspi_get_desktop(0);
+  int count = atspi_accessible_get_child_count(desktop, NULL);
+  for (int i = 0; pid != 0 && focusedAccessible_ == NULL && i < count; i++) {
+    AtspiAccessible* application =
+        atspi_accessible_get_child_at_index(desktop, i, NULL);
+    if (application == NULL) {
+      continue;
+    }
+
+    if (atspi_accessible_get_process_id(application, NULL) == pid) {
+      focusedAccessible_ = FindFocusedAccessible(application, 0);
+    }
+
+    g_object_unref(application);
+  }
+
+  g_object_unref(desktop);
+  return focusedAccessible_;
+}
+
 std::tuple<int, bool, bool> GetKeycodeAndModifiers(Display* display,
                                                    const std::string& key) {
+  static Histogram& stat = Stat("driver::GetKeycodeAndModifiers");
+  Timer timer(stat);
   std::tuple<int, bool, bool> result;
   std::get<0>(result) = -1;
 
-  // convert our key names to the corresponding x11 key
-  std::string mapped = key;
-  if (key == "escape") {
-    mapped = "Escape";
-  } else if (key == "control" || key == "ctrl" || key == "commandOrControl") {
-    mapped = "Control_L";
-  } else if (key == "alt" || key == "option") {
-    mapped = "Alt_L";
-  } else if (key == "altgr") {
-    mapped = "ISO_Level3_Shift";
-  } else if (key == "meta" || key == "windows" || key == "win") {
-    mapped = "Super_L";
-  } else if (key == "shift") {
-    mapped = "Shift_L";
-  } else if (key == "`") {
-    mapped = "grave";
-  } else if (key == "~") {
-    mapped = "asciitilde";
-  } else if (key == "!") {
-    mapped = "exclam";
-  } else if (key == "@") {
-    mapped = "at";
-  } else if (key == "#") {
-    mapped = "numbersign";
-  } else if (key == "$") {
-    mapped = "dollar";
-  } else if (key == "%") {
-    mapped = "percent";
-  } else if (key == "^") {
-    mapped = "asciicircum";
-  } else if (key == "&") {
-    mapped = "ampersand";
-  } else if (key == "*") {
-    mapped = "asterisk";
-  } else if (key == "(") {
-    mapped = "parenleft";
-  } else if (key == ")") {
-    mapped = "parenright";
-  } else if (key == "-") {
-    mapped = "minus";
-  } else if (key == "_") {
-    mapped = "underscore";
-  } else if (key == "+") {
-    mapped = "plus";
-  } else if (key == "=") {
-    mapped = "equal";
-  } else if (key == "backspace") {
-    mapped = "BackSpace";
-  } else if (key == "tab" || key == "\t") {
-    mapped = "Tab";
-  } else if (key == "[") {
-    mapped = "bracketleft";
-  } else if (key == "{") {
-    mapped = "braceleft";
-  } else if (key == "]") {
-    mapped = "bracketright";
-  } else if (key == "}") {
-    mapped = "braceright";
-  } else if (key == "\\") {
-    mapped = "backslash";
-  } else if (key == "|") {
-    mapped = "bar";
-  } else if (key == "caps") {
-    mapped = "Caps_Lock";
-  } else if (key == ";") {
-    mapped = "semicolon";
-  } else if (key == ":") {
-    mapped = "colon";
-  } else if (key == "'") {
-    mapped = "apostrophe";
-  } else if (key == "\"") {
-    mapped = "quotedbl";
-  } else if (key == "enter" || key == "return" || key == "\n") {
-    mapped = "Return";
-  } else if (key == ",") {
-    mapped = "comma";
-  } else if (key == "<") {
-    mapped = "less";
-  } else if (key == ".") {
-    mapped = "period";
-  } else if (key == ">") {
-    mapped = "greater";
-  } else if (key == "/") {
-    mapped = "slash";
-  } else if (key == "?") {
-    mapped = "question";
-  } else if (key == "space" || key == " ") {
-    mapped = "space";
-  } else if (key == "home") {
-    mapped = "Home";
-  } else if (key == "end") {
-    mapped = "End";
-  } else if (key == "left") {
-    mapped = "Left";
-  } else if (key == "right") {
-    mapped = "Right";
-  } else if (key == "up") {
-    mapped = "Up";
-  } else if (key == "down") {
-    mapped = "Down";
-  } else if (key == "pageup") {
-    mapped = "Prior";
-  } else if (key == "pagedown") {
-    mapped = "Next";
-  } else if (key == "delete") {
-    mapped = "Delete";
-  } else if (key == "f1") {
-    mapped = "F1";
-  } else if (key == "f2") {
-    mapped = "F2";
-  } else if (key == "f3") {
-    mapped = "F3";
-  } else if (key == "f4") {
-    mapped = "F4";
-  } else if (key == "f5") {
-    mapped = "F5";
-  } else if (key == "f6") {
-    mapped = "F6";
-  } else if (key == "f7") {
-    mapped = "F7";
-  } else if (key == "f8") {
-    mapped = "F8";
-  } else if (key == "f9") {
-    mapped = "F9";
-  } else if (key == "f10") {
-    mapped = "F10";
-  } else if (key == "f11") {
-    mapped = "F11";
-  } else if (key == "f12") {
-    mapped = "F12";
-  }
-
-  // search the printable ASCII table range for the string that would be typed
-  // with the given keysym and shift modifier combination. because keycodes
-  // refer to physical keys, we need to handle the state of the shift key
-  // ourselves, and we also need to make sure we're using the current keyboard
-  // layout, not just assuming en_US
-  XkbStateRec state;
-  XkbGetState(display, XkbUseCoreKbd, &state);
-  for (int i = 0; i < 256; i++) {
-    for (int shift = 0; shift < 2; shift++) {
-      for (int altgr = 0; altgr < 2; altgr++) {
-        int modifier = state.group << 13;
-        if (shift == 1) {
-          modifier |= ShiftMask;
-        }
-        if (altgr == 1) {
-          modifier |= Mod5Mask;
-        }
+  // convert our key names to the corresponding x11 keysym. a single character
+  // is converted to its keysym, and anything else is tried as the name of an
+  // x11 keysym (e.g., "Prior").
+  KeySym keysym = NoSymbol;
+  const Key* named = FindKey(key);
+  long codepoint = Codepoint(key);
+  if (named != NULL) {
+    keysym = named->code;
+  } else if (codepoint >= 0x20 && codepoint != 0x7f) {
+    // latin-1 characters are their own keysyms, and every other character has
+    // a keysym in the unicode range
+    keysym = codepoint <= 0xff ? codepoint : 0x01000000 | codepoint;
+  } else {
+    keysym = XStringToKeysym(key.c_str());
+  }
 
-        KeySym k;
-        XkbLookupKeySym(display, i, modifier, NULL, &k);
-        const char* s = XKeysymToString(k);
-        if (s == NULL) {
-          continue;
-        }
+  if (keysym == NoSymbol) {
+    return result;
+  }
 
-        std::string name(s);
-        if (mapped == name) {
-          std::get<0>(result) = i;
-          std::get<1>(result) = shift == 1;
-          std::get<2>(result) = altgr == 1;
-          return result;
-        }
-      }
-    }
+  ProcessEvents(display);
+  if (keycodesStale_) {
+    LoadKeycodes(display);
+  }
+
+  std::unordered_map<KeySym, std::tuple<int, bool, bool>>::iterator keycode =
+      keycodes_.find(keysym);
+  if (keycode != keycodes_.end()) {
+    result = keycode->second;
+  } else if (codepoint != -1) {
+    std::get<0>(result) = RemapKeycode(display, keysym);
   }
 
   return result;
@@ -392,7 +902,11 @@ int GetMouseButton(const std::string& button) {
 
 std::tuple<int, int> GetMouseLocation() {
   std::tuple<int, int> result;
-  Display* display = XOpenDisplay(NULL);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return result;
+  }
+
   Window root = XDefaultRootWindow(display);
   if (root == 0) {
     return result;
@@ -407,123 +921,1432 @@ std::tuple<int, int> GetMouseLocation() {
   unsigned int mask;
   XQueryPointer(display, root, &rootReturn, &childReturn, &x, &y, &windowX,
                 &windowY, &mask);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
 
   std::get<0>(result) = x;
   std::get<1>(result) = y;
-  XCloseDisplay(display);
   return result;
 }
 
-void GetProperty(Display* display, Window window, const std::string& property,
+void GetProperty(Display* display, Window window, Atom property,
                  unsigned char** result, unsigned long* length) {
-  Atom atom = XInternAtom(display, property.c_str(), 1);
   unsigned long actual_type = 0;
   int actual_format = 0;
   unsigned long bytes_after = 0;
-  XGetWindowProperty(display, window, atom, 0, 1024, 0, 0, &actual_type,
+  XGetWindowProperty(display, window, property, 0, 1024, 0, 0, &actual_type,
                      &actual_format, length, &bytes_after, result);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  PROBE3(property_fetch, window, property, *length);
 }
 
 std::vector<std::string> GetRunningApplications() {
-  Display* display = XOpenDisplay(NULL);
-  std::vector<Window> windows = GetAllWindows(display);
-
   std::vector<std::string> result;
-  for (Window window : windows) {
-    std::string name = ProcessName(display, window);
-    name.erase(std::find(name.begin(), name.end(), '\0'), name.end());
-    result.push_back(name);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return result;
   }
 
-  std::sort(result.begin(), result.end());
-  result.erase(std::unique(result.begin(), result.end()), result.end());
-  return result;
-}
-
-void MouseDown(Display* display, const std::string& button) {
-  XTestFakeButtonEvent(display, GetMouseButton(button), true, 0);
-  XFlush(display);
-  usleep(10000);
+  ProcessEvents(display);
+  UpdateWindows(display);
+  return runningApplications_;
 }
 
-void MouseUp(Display* display, const std::string& button) {
-  XTestFakeButtonEvent(display, GetMouseButton(button), false, 0);
-  XFlush(display);
-  usleep(10000);
-}
+std::string GetSelection(Display* display, Window window, Atom selection) {
+  if (window == 0) {
+    return "";
+  }
 
-void PressKey(Display* display, std::string key,
-              std::vector<std::string> modifiers) {
-  std::tuple<int, bool, bool> keycodeAndModifiers =
-      GetKeycodeAndModifiers(display, key);
-  int keycode = std::get<0>(keycodeAndModifiers);
-  bool shift = std::get<1>(keycodeAndModifiers);
-  bool altgr = std::get<2>(keycodeAndModifiers);
+  // property changes are how large transfers are sent
+  XSelectInput(display, window, PropertyChangeMask);
+
+  // ask which formats the owner supports, so we can get text as utf-8 rather
+  // than latin-1 whenever possible. plenty of older owners don't answer
+  // TARGETS at all, so if it fails, STRING is still worth trying.
+  Atom target = XA_STRING;
+  Atom type = None;
+  int format = 0;
+  std::string targets;
+  if (ConvertSelection(display, window, selection, atoms_.targets, targets,
+                       type, format) &&
+      type == XA_ATOM && format == 32) {
+    bool text = false;
+    const long* available = (const long*)targets.data();
+    for (size_t i = 0; i < targets.length() / sizeof(long); i++) {
+      if ((Atom)available[i] == atoms_.utf8String) {
+        target = atoms_.utf8String;
+        text = true;
+      } else if ((Atom)available[i] == XA_STRING) {
+        text = true;
+      }
+    }
 
-  if (keycode == -1) {
-    return;
+    // the owner has something, but it isn't text
+    if (!text) {
+      return "";
+    }
   }
 
-  if (shift) {
-    ToggleKey(display, "shift", true);
+  std::string result;
+  if (!ConvertSelection(display, window, selection, target, result, type,
+                        format)) {
+    return "";
   }
-  if (altgr) {
-    ToggleKey(display, "altgr", true);
+
+  // STRING is latin-1, and everything else expects utf-8
+  return type == XA_STRING ? Latin1ToUtf8(result) : result;
+}
+
+std::vector<unsigned long> GetWindowPids(Display* display,
+                                         const std::vector<Window>& windows) {
+  // send every request before waiting for any of the replies, so looking up
+  // any number of windows takes a single round trip. xlib can only wait for
+  // one reply at a time, so this uses xcb on the same connection instead.
+  xcb_connection_t* connection = XGetXCBConnection(display);
+  std::vector<xcb_get_property_cookie_t> cookies;
+  for (Window window : windows) {
+    cookies.push_back(xcb_get_property(connection, 0, window, atoms_.netWmPid,
+                                       XCB_GET_PROPERTY_TYPE_ANY, 0, 1));
   }
 
-  for (std::string modifier : modifiers) {
-    ToggleKey(display, modifier, true);
+  std::vector<unsigned long> result;
+  if (!windows.empty()) {
+    roundTrips_.fetch_add(1, std::memory_order_relaxed);
   }
 
-  ToggleKey(display, key, true);
-  ToggleKey(display, key, false);
+  for (size_t i = 0; i < cookies.size(); i++) {
+    xcb_generic_error_t* error = NULL;
+    xcb_get_property_reply_t* reply =
+        xcb_get_property_reply(connection, cookies[i], &error);
+    PROBE3(property_fetch, windows[i], atoms_.netWmPid,
+           reply == NULL ? 0 : xcb_get_property_value_length(reply));
+    unsigned long pid = 0;
+    if (reply != NULL && reply->format == 32 &&
+        xcb_get_property_value_length(reply) >= 4) {
+      pid = *(uint32_t*)xcb_get_property_value(reply);
+    }
 
-  for (std::string modifier : modifiers) {
-    ToggleKey(display, modifier, false);
+    // a window can be destroyed before we get to it, which is an error
+    free(error);
+    free(reply);
+    result.push_back(pid);
   }
 
-  if (altgr) {
-    ToggleKey(display, "altgr", false);
+  return result;
+}
+
+bool InitializeAccessibility() {
+  if (accessibilityInitialized_) {
+    return true;
   }
-  if (shift) {
-    ToggleKey(display, "shift", false);
+
+  // the connection to the accessibility bus stays open for the life of the
+  // worker thread, and applications that hang shouldn't hang us with them
+  int status = atspi_init();
+  if (status != 0 && status != 1) {
+    return false;
   }
 
-  usleep(3000);
+  // the default main context belongs to whoever runs a glib main loop in this
+  // process (e.g., electron's main thread), so the bus is moved to a context
+  // of our own, which only the worker thread ever iterates. that way, event
+  // callbacks always run on the worker, alongside everything they touch.
+  accessibilityContext_ = g_main_context_new();
+  atspi_set_main_context(accessibilityContext_);
+  atspi_set_timeout(kAccessibilityTimeout, -1);
+  focusListener_ = atspi_event_listener_new_simple(OnFocusChanged, NULL);
+  atspi_event_listener_register(focusListener_, "object:state-changed:focused",
+                                NULL);
+  accessibilityInitialized_ = true;
+  return true;
 }
 
-std::string ProcessName(Display* display, Window window) {
-  if (window == 0) {
+Atoms InternAtoms(Display* display) {
+  // interning every atom in one request is a single round trip, rather than
+  // one for each atom
+  const char* names[] = {"CLIPBOARD",        "INCR",        "_NET_ACTIVE_WINDOW",
+                         "_NET_CLIENT_LIST", "_NET_WM_PID", "TARGETS",
+                         "TEXT",             "UTF8_STRING", "XSEL_DATA"};
+  Atom atoms[9] = {None};
+  XInternAtoms(display, (char**)names, 9, False, atoms);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+
+  Atoms result;
+  result.clipboard = atoms[0];
+  result.incr = atoms[1];
+  result.netActiveWindow = atoms[2];
+  result.netClientList = atoms[3];
+  result.netWmPid = atoms[4];
+  result.targets = atoms[5];
+  result.text = atoms[6];
+  result.utf8String = atoms[7];
+  result.xselData = atoms[8];
+  return result;
+}
+
+bool IsSpareKeycode(int keycode) {
+  for (const std::pair<int, KeySym>& spare : spareKeycodes_) {
+    if (spare.first == keycode) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string Latin1ToUtf8(const std::string& text) {
+  std::string result;
+  for (unsigned char c : text) {
+    // everything in latin-1 past ascii is two bytes in utf-8
+    if (c < 0x80) {
+      result += c;
+    } else {
+      result += (char)(0xc0 | (c >> 6));
+      result += (char)(0x80 | (c & 0x3f));
+    }
+  }
+
+  return result;
+}
+
+void LoadKeycodes(Display* display) {
+  keycodes_.clear();
+
+  int minKeycode = 0;
+  int maxKeycode = 0;
+  XDisplayKeycodes(display, &minKeycode, &maxKeycode);
+
+  // keycodes that don't produce anything are free for us to remap when typing
+  // characters that aren't in the layout. keep the ones we've already remapped
+  // (in their current order) as long as nothing else has changed them.
+  int perKeycode = 0;
+  KeySym* mapping = XGetKeyboardMapping(display, minKeycode,
+                                        maxKeycode - minKeycode + 1,
+                                        &perKeycode);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  std::unordered_map<int, KeySym> current;
+  for (int i = minKeycode; i <= maxKeycode && mapping != NULL; i++) {
+    KeySym* keysyms = mapping + (i - minKeycode) * perKeycode;
+    current[i] = NoSymbol;
+    for (int j = 0; j < perKeycode; j++) {
+      if (keysyms[j] != NoSymbol) {
+        current[i] = keysyms[0];
+        break;
+      }
+    }
+  }
+
+  if (mapping != NULL) {
+    XFree(mapping);
+  }
+
+  std::list<std::pair<int, KeySym>> spare;
+  for (const std::pair<int, KeySym>& keycode : spareKeycodes_) {
+    if (current[keycode.first] == keycode.second) {
+      spare.push_back(keycode);
+    } else if (current[keycode.first] == NoSymbol) {
+      spare.push_back(std::make_pair(keycode.first, NoSymbol));
+    }
+
+    current.erase(keycode.first);
+  }
+
+  for (int i = minKeycode; i <= maxKeycode; i++) {
+    if (current.find(i) != current.end() && current[i] == NoSymbol) {
+      spare.push_back(std::make_pair(i, NoSymbol));
+    }
+  }
+
+  spareKeycodes_ = spare;
+
+  // search every other keycode for the keysym it produces with each
+  // combination of shift and altgr. because keycodes refer to physical keys,
+  // we need to handle the state of the shift key ourselves, and we also need to
+  // make sure we're using the current keyboard layout, not just assuming en_US.
+  // the first combination found for a keysym wins.
+  XkbStateRec state;
+  XkbGetState(display, XkbUseCoreKbd, &state);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  for (int i = minKeycode; i <= maxKeycode; i++) {
+    if (IsSpareKeycode(i)) {
+      continue;
+    }
+
+    for (int shift = 0; shift < 2; shift++) {
+      for (int altgr = 0; altgr < 2; altgr++) {
+        int modifier = state.group << 13;
+        if (shift == 1) {
+          modifier |= ShiftMask;
+        }
+        if (altgr == 1) {
+          modifier |= Mod5Mask;
+        }
+
+        KeySym k = NoSymbol;
+        XkbLookupKeySym(display, i, modifier, NULL, &k);
+        if (k != NoSymbol && keycodes_.find(k) == keycodes_.end()) {
+          keycodes_[k] = std::make_tuple(i, shift == 1, altgr == 1);
+        }
+      }
+    }
+  }
+
+  keycodesStale_ = false;
+}
+
+void MouseDown(const std::string& button) {
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return;
+  }
+
+  {
+    Span span("XTestFakeButtonEvent");
+    XTestFakeButtonEvent(display, GetMouseButton(button), true, 0);
+    PROBE2(button, GetMouseButton(button), true);
+  }
+
+  Pace(display, 10000);
+}
+
+void MouseUp(const std::string& button) {
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return;
+  }
+
+  {
+    Span span("XTestFakeButtonEvent");
+    XTestFakeButtonEvent(display, GetMouseButton(button), false, 0);
+    PROBE2(button, GetMouseButton(button), false);
+  }
+
+  Pace(display, 10000);
+}
+
+bool NextEvent(Display* display, XEvent& event, const timespec& deadline) {
+  Span span("NextEvent");
+  while (XPending(display) == 0) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long remaining = Elapsed(now, deadline);
+    if (remaining <= 0) {
+      return false;
+    }
+
+    pollfd fds[1] = {{ConnectionNumber(display), POLLIN, 0}};
+    poll(fds, 1, (remaining + 999) / 1000);
+  }
+
+  XNextEvent(display, &event);
+  return true;
+}
+
+int OnError(Display* display, XErrorEvent* event) { return 0; }
+
+void OnFocusChanged(const AtspiEvent* event) {
+  if (event->detail1 == 0) {
+    if (event->source == focusedAccessible_) {
+      g_object_unref(focusedAccessible_);
+      focusedAccessible_ = NULL;
+    }
+
+    return;
+  }
+
+  if (focusedAccessible_ != NULL) {
+    g_object_unref(focusedAccessible_);
+  }
+
+  focusedAccessible_ = (AtspiAccessible*)g_object_ref(event->source);
+}
+
+void OnIOError(Display* display, void* data) {
+  // connections other than the driver's own pass a flag of their own
+  if (data != NULL) {
+    *(bool*)data = true;
+  } else {
+    displayLost_ = true;
+  }
+}
+
+void OnTextEvent(const AtspiEvent* event) {
+  if (event->source != editorAccessible_ || editorStale_) {
+    return;
+  }
+
+  std::string type = event->type;
+  if (type.find("caret-moved") != std::string::npos) {
+    editorCaret_ = event->detail1;
+    return;
+  }
+
+  bool insert = type.find(":insert") != std::string::npos;
+  bool remove = type.find(":delete") != std::string::npos;
+  int length = remove ? event->detail2 : 0;
+  long start = Utf8Offset(editorText_, event->detail1);
+  long end = Utf8Offset(editorText_, event->detail1 + length);
+  if ((!insert && !remove) || start < 0 || end < 0 ||
+      !G_VALUE_HOLDS_STRING(&event->any_data)) {
+    editorStale_ = true;
+    return;
+  }
+
+  // deletions come with the text that was removed, so if that isn't what we
+  // have, we've lost track of the field and need to read it again
+  std::string text = g_value_get_string(&event->any_data);
+  if (remove && editorText_.compare(start, end - start, text) != 0) {
+    editorStale_ = true;
+    return;
+  }
+
+  EditorChange change;
+  change.start = Utf16Offset(editorText_, event->detail1);
+  change.end = Utf16Offset(editorText_, event->detail1 + length);
+  if (insert) {
+    change.text = text;
+    editorText_.insert(start, text);
+  } else {
+    editorText_.erase(start, end - start);
+  }
+
+  editorVersion_++;
+  editorChanges_.push_back(std::make_pair(editorVersion_, change));
+  if (editorChanges_.size() > kEditorHistory) {
+    editorBaseVersion_ = editorChanges_.front().first;
+    editorChanges_.pop_front();
+  }
+}
+
+Display* OpenDisplay() {
+  // the worker, clipboard owner, and monitor each have a connection on their
+  // own thread, and any of them can be first, so whichever is makes xlib
+  // thread-safe before connecting
+  static bool threads = XInitThreads();
+  (void)threads;
+  return XOpenDisplay(NULL);
+}
+
+void Pace(Display* display, int delay) {
+  if (pacing_.mode == PacingMode::Delay) {
+    {
+      Span span("XFlush");
+      XFlush(display);
+      PROBE1(flush, 0);
+    }
+
+    timeline_.Wait(delay);
+    return;
+  }
+
+  // a round trip means the server has handled every event we sent before it,
+  // so we only ever get a few events ahead of whatever is consuming them
+  if (++pacedEvents_ >= pacing_.syncInterval) {
+    Span span("XSync");
+    XSync(display, False);
+    roundTrips_.fetch_add(1, std::memory_order_relaxed);
+    PROBE1(flush, 1);
+    pacedEvents_ = 0;
+  } else {
+    Span span("XFlush");
+    XFlush(display);
+    PROBE1(flush, 0);
+  }
+}
+
+bool PasteText(const std::string& text) {
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return false;
+  }
+
+  Window focus = None;
+  int revert = 0;
+  XGetInputFocus(display, &focus, &revert);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (focus == None || focus == PointerRoot) {
+    return false;
+  }
+
+  unsigned long color = BlackPixel(display, DefaultScreen(display));
+  Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0,
+                                      1, 1, 0, color, color);
+  std::string previous = GetClipboard(display, window);
+  XDestroyWindow(display, window);
+
+  int transfers = 0;
+  {
+    std::lock_guard<std::mutex> lock(clipboardMutex_);
+    transfers = clipboardTransfers_;
+    clipboardPaster_ = focus;
+  }
+
+  if (!SetClipboard(text, true)) {
+    std::lock_guard<std::mutex> lock(clipboardMutex_);
+    clipboardPaster_ = None;
+    return false;
+  }
+
+  // wait for the focused application to fetch the text before putting the old
+  // clipboard back, or it might paste the wrong thing
+  PressKey("v", std::vector<std::string>{"control"});
+  {
+    Span span("paste wait");
+    std::unique_lock<std::mutex> lock(clipboardMutex_);
+    clipboardChanged_.wait_for(lock, std::chrono::seconds(1), [=] {
+      return clipboardTransfers_ > transfers;
+    });
+    clipboardPaster_ = None;
+  }
+
+  SetClipboard(previous, previous != "");
+  return true;
+}
+
+void PressKey(std::string key, std::vector<std::string> modifiers) {
+  static Histogram& stat = Stat("driver::PressKey");
+  Timer timer(stat);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return;
+  }
+
+  std::tuple<int, bool, bool> keycodeAndModifiers =
+      GetKeycodeAndModifiers(display, key);
+  int keycode = std::get<0>(keycodeAndModifiers);
+  bool shift = std::get<1>(keycodeAndModifiers);
+  bool altgr = std::get<2>(keycodeAndModifiers);
+
+  if (keycode == -1) {
+    return;
+  }
+
+  if (shift) {
+    ToggleKey(display, "shift", true);
+  }
+  if (altgr) {
+    ToggleKey(display, "altgr", true);
+  }
+
+  for (std::string modifier : modifiers) {
+    ToggleKey(display, modifier, true);
+  }
+
+  ToggleKey(display, key, true);
+  ToggleKey(display, key, false);
+
+  for (std::string modifier : modifiers) {
+    ToggleKey(display, modifier, false);
+  }
+
+  if (altgr) {
+    ToggleKey(display, "altgr", false);
+  }
+  if (shift) {
+    ToggleKey(display, "shift", false);
+  }
+
+  Pace(display, 3000);
+}
+
+void ProcessAccessibilityEvents() {
+  if (!accessibilityInitialized_) {
+    return;
+  }
+
+  while (g_main_context_iteration(accessibilityContext_, FALSE)) {
+  }
+}
+
+void ProcessEvent(Display* display, XEvent& event) {
+  if (event.type == MappingNotify) {
+    XRefreshKeyboardMapping(&event.xmapping);
+
+    // remapping one of our spare keycodes doesn't change any other key
+    if (event.xmapping.request != MappingKeyboard ||
+        event.xmapping.count != 1 ||
+        !IsSpareKeycode(event.xmapping.first_keycode)) {
+      keycodesStale_ = true;
+    }
+  } else if (event.type == PropertyNotify &&
+             event.xproperty.window == XDefaultRootWindow(display) &&
+             event.xproperty.atom == atoms_.netClientList) {
+    windowsStale_ = true;
+  } else if (xfixesEventBase_ != -1 &&
+             event.type == xfixesEventBase_ + XFixesSelectionNotify) {
+    // the keys that make an application take a selection are sent a lookup at
+    // a time, and each lookup handles whatever is queued, so an owner change
+    // can arrive well before anything is waiting for it
+    ownerChanges_.push_back((XFixesSelectionNotifyEvent&)event);
+  } else if (xkbEventBase_ != -1 && event.type == xkbEventBase_) {
+    XkbEvent& xkb = reinterpret_cast<XkbEvent&>(event);
+    if (xkb.any.xkb_type == XkbNewKeyboardNotify ||
+        (xkb.any.xkb_type == XkbStateNotify &&
+         (xkb.state.changed & XkbGroupStateMask))) {
+      keycodesStale_ = true;
+    }
+  }
+}
+
+void ProcessEvents(Display* display) {
+  while (XEventsQueued(display, QueuedAfterReading) > 0) {
+    XEvent event;
+    XNextEvent(display, &event);
+    ProcessEvent(display, event);
+  }
+}
+
+std::string ProcessName(Display* display, Window window) {
+  if (window == 0) {
     return "";
   }
 
   unsigned long length = 0;
   unsigned char* property = 0;
-  GetProperty(display, window, "_NET_WM_PID", &property, &length);
+  GetProperty(display, window, atoms_.netWmPid, &property, &length);
   if (property == 0) {
     return "";
   }
 
-  unsigned long* pid = (unsigned long*)property;
-  std::ifstream t(std::string("/proc/") + std::to_string(*pid) +
-                  std::string("/cmdline"));
-  std::string path((std::istreambuf_iterator<char>(t)),
-                   std::istreambuf_iterator<char>());
+  unsigned long pid = *(unsigned long*)property;
+  XFree(property);
+  return ProcessPath(pid);
+}
+
+std::string ProcessPath(unsigned long pid) {
+  static Histogram& stat = Stat("driver::ProcessPath");
+  Timer timer(stat);
 
+  // a pid can be reused once its process exits, so a cached name is only valid
+  // for the process that started at the same time
+  std::string directory = std::string("/proc/") + std::to_string(pid);
+  unsigned long long startTime = ProcessStartTime(ReadFile(directory + "/stat"));
+  if (startTime == 0) {
+    processPaths_.erase(pid);
+    return "";
+  }
+
+  std::unordered_map<unsigned long,
+                     std::pair<unsigned long long, std::string>>::iterator
+      cached = processPaths_.find(pid);
+  if (cached != processPaths_.end() && cached->second.first == startTime) {
+    return cached->second.second;
+  }
+
+  std::string path = ReadFile(directory + "/cmdline");
   if (path.length() > 0 && path[path.length() - 1] == '\x00') {
     path = path.substr(0, path.length() - 1);
   }
 
-  XFree(pid);
   ToLower(path);
   RemoveSpaces(path);
+  processPaths_[pid] = std::make_pair(startTime, path);
   return path;
 }
 
+unsigned long long ProcessStartTime(const std::string& stat) {
+  // the process name is in parentheses and can contain anything, including
+  // spaces and parentheses, so fields are counted from the last parenthesis.
+  // the start time is the 22nd field, and the 20th after the name.
+  size_t end = stat.rfind(')');
+  if (end == std::string::npos) {
+    return 0;
+  }
+
+  size_t field = end + 1;
+  for (int i = 0; i < 19 && field != std::string::npos; i++) {
+    field = stat.find(' ', field + 1);
+  }
+
+  if (field == std::string::npos) {
+    return 0;
+  }
+
+  return strtoull(stat.c_str() + field + 1, NULL, 10);
+}
+
+bool ReadAccessibleText(AtspiAccessible* accessible, std::string& text,
+                        int& caret) {
+  AtspiText* iface = atspi_accessible_get_text_iface(accessible);
+  if (iface == NULL) {
+    return false;
+  }
+
+  GError* error = NULL;
+  gchar* contents = NULL;
+  int characters = atspi_text_get_character_count(iface, &error);
+  if (error == NULL) {
+    contents = atspi_text_get_text(iface, 0, characters, &error);
+  }
+
+  if (error == NULL) {
+    caret = std::max(atspi_text_get_caret_offset(iface, &error), 0);
+  }
+
+  bool result = error == NULL && contents != NULL;
+  if (result) {
+    text = contents;
+  } else if (accessible == focusedAccessible_) {
+    // most likely, the application went away, so look for the focus again
+    g_object_unref(focusedAccessible_);
+    focusedAccessible_ = NULL;
+  }
+
+  g_clear_error(&error);
+  g_free(contents);
+  g_object_unref(iface);
+  return result;
+}
+
+std::string ReadFile(const std::string& path) {
+  procReads_.fetch_add(1, std::memory_order_relaxed);
+  std::string result;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return result;
+  }
+
+  char buffer[4096];
+  ssize_t length = 0;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    result.append(buffer, length);
+  }
+
+  close(fd);
+  return result;
+}
+
+std::string ReadPrimary(Display* display, Window window,
+                        const std::string& key,
+                        const std::vector<std::string>& modifiers) {
+  // selecting text with the keyboard makes the focused application take the
+  // primary selection, so once it has, its reply reflects the keys we sent.
+  // if it never does, nothing is selected.
+  Window focus = None;
+  int revert = 0;
+  XGetInputFocus(display, &focus, &revert);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (focus == None || focus == PointerRoot) {
+    PressKey(key, modifiers);
+    return "";
+  }
+
+  // windows created by the same client share the bits outside this mask
+  uint32_t mask = xcb_get_setup(XGetXCBConnection(display))->resource_id_mask;
+  if (xfixesEventBase_ == -1) {
+    // without xfixes, there's no telling when the application has caught up,
+    // so settle for whatever it owns once it's handled the keys
+    PressKey(key, modifiers);
+    XSync(display, False);
+    Window owner = XGetSelectionOwner(display, XA_PRIMARY);
+    roundTrips_.fetch_add(2, std::memory_order_relaxed);
+    if (owner == None || (owner & ~mask) != (focus & ~mask)) {
+      return "";
+    }
+
+    return GetSelection(display, window, XA_PRIMARY);
+  }
+
+  // an application that already owns the selection isn't necessarily done.
+  // multi-process ones (e.g., chromium and electron) update it asynchronously
+  // after handling the keys, and like gtk, they take ownership again on every
+  // change, so wait for that. ownership is timestamped, so a change from before
+  // the keys were sent isn't mistaken for one caused by them.
+  ownerChanges_.clear();
+  XFixesSelectSelectionInput(display, window, XA_PRIMARY,
+                             XFixesSetSelectionOwnerNotifyMask);
+  Time since = ServerTime(display, window);
+  PressKey(key, modifiers);
+  bool selected = WaitForOwner(
+      display, XA_PRIMARY, [=](const XFixesSelectionNotifyEvent& change) {
+        return change.owner != None &&
+               (change.owner & ~mask) == (focus & ~mask) &&
+               change.selection_timestamp >= since;
+      });
+
+  XFixesSelectSelectionInput(display, window, XA_PRIMARY, 0);
+  ownerChanges_.clear();
+  return selected ? GetSelection(display, window, XA_PRIMARY) : "";
+}
+
+void ReadProperty(Display* display, Window window, Atom property,
+                  std::string& result, Atom& type, int& format) {
+  unsigned char* data = NULL;
+  unsigned long length = 0;
+  unsigned long remaining = 0;
+  XGetWindowProperty(display, window, property, 0, LONG_MAX / 4, True,
+                     AnyPropertyType, &type, &format, &length, &remaining,
+                     &data);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  PROBE3(property_fetch, window, property, length);
+  if (data == NULL) {
+    return;
+  }
+
+  // xlib returns 32-bit items as longs, whatever their size on the server
+  size_t size = format == 32 ? sizeof(long) : format / 8;
+  result.append((const char*)data, length * size);
+  XFree(data);
+}
+
+int RemapKeycode(Display* display, KeySym keysym) {
+  for (std::list<std::pair<int, KeySym>>::iterator i = spareKeycodes_.begin();
+       i != spareKeycodes_.end(); i++) {
+    if (i->second == keysym) {
+      spareKeycodes_.splice(spareKeycodes_.begin(), spareKeycodes_, i);
+      return i->first;
+    }
+  }
+
+  if (spareKeycodes_.empty()) {
+    return -1;
+  }
+
+  // reuse the least recently used spare keycode, so repeated characters don't
+  // need to be remapped. make sure the server has handled every event we sent
+  // with the old keysym before changing it out from under them.
+  std::list<std::pair<int, KeySym>>::iterator last =
+      std::prev(spareKeycodes_.end());
+  KeySym keysyms[2] = {keysym, keysym};
+  XSync(display, False);
+  XChangeKeyboardMapping(display, last->first, 2, keysyms, 1);
+  XSync(display, False);
+  roundTrips_.fetch_add(2, std::memory_order_relaxed);
+
+  last->second = keysym;
+  spareKeycodes_.splice(spareKeycodes_.begin(), spareKeycodes_, last);
+  return last->first;
+}
+
+void RunClipboardOwner() {
+  // like the monitor, losing the server ends this thread rather than the
+  // process, and the next SetClipboard starts over with a new connection
+  Display* display = OpenDisplay();
+  bool lost = display == NULL;
+  Window window = 0;
+  if (display != NULL) {
+    XSetIOErrorExitHandler(display, OnIOError, &lost);
+    unsigned long color = BlackPixel(display, DefaultScreen(display));
+    window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1,
+                                 1, 0, color, color);
+  }
+
+  Atoms atoms = display == NULL ? Atoms() : InternAtoms(display);
+  {
+    std::lock_guard<std::mutex> lock(clipboardMutex_);
+    clipboardWindow_ = window;
+  }
+
+  std::string text;
+  bool owner = false;
+  std::vector<Transfer> transfers;
+  while (!lost) {
+    // wait until either the server or the driver thread has something for us
+    if (XPending(display) == 0 && !lost) {
+      pollfd fds[2] = {{ConnectionNumber(display), POLLIN, 0},
+                       {clipboardWake_[0], POLLIN, 0}};
+      poll(fds, 2, -1);
+    }
+
+    char buffer[64];
+    while (read(clipboardWake_[0], buffer, sizeof(buffer)) > 0) {
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(clipboardMutex_);
+      if (clipboardApplied_ != clipboardRequested_) {
+        text = clipboardText_;
+        if (clipboardOwned_) {
+          XSetSelectionOwner(display, atoms.clipboard, window, CurrentTime);
+          owner = XGetSelectionOwner(display, atoms.clipboard) == window;
+        } else if (owner) {
+          XSetSelectionOwner(display, atoms.clipboard, None, CurrentTime);
+          owner = false;
+        }
+
+        clipboardOwned_ = owner;
+        clipboardApplied_ = clipboardRequested_;
+        clipboardChanged_.notify_all();
+      }
+
+      if (clipboardWake_[1] == -1) {
+        break;
+      }
+    }
+
+    while (!lost && XPending(display) > 0) {
+      XEvent event;
+      XNextEvent(display, &event);
+      if (event.type == SelectionRequest && owner) {
+        AnswerSelectionRequest(display, atoms, event.xselectionrequest, text,
+                               transfers);
+      } else if (event.type == SelectionRequest) {
+        XSelectionEvent reply = {};
+        reply.type = SelectionNotify;
+        reply.requestor = event.xselectionrequest.requestor;
+        reply.selection = event.xselectionrequest.selection;
+        reply.target = event.xselectionrequest.target;
+        reply.time = event.xselectionrequest.time;
+        reply.property = None;
+        XSendEvent(display, reply.requestor, False, NoEventMask,
+                   (XEvent*)&reply);
+        XFlush(display);
+      } else if (event.type == SelectionClear) {
+        // someone else copied something, so the clipboard isn't ours anymore
+        owner = false;
+        std::lock_guard<std::mutex> lock(clipboardMutex_);
+        clipboardOwned_ = false;
+      } else if (event.type == PropertyNotify) {
+        ContinueTransfer(display, event.xproperty, transfers);
+      }
+    }
+  }
+
+  if (lost) {
+    // nothing we owned survives the connection, so don't leave the driver
+    // thread waiting on a request that can't be applied
+    std::lock_guard<std::mutex> lock(clipboardMutex_);
+    clipboardLost_ = true;
+    clipboardOwned_ = false;
+    clipboardApplied_ = clipboardRequested_;
+    clipboardWindow_ = 0;
+    clipboardChanged_.notify_all();
+  } else {
+    XDestroyWindow(display, window);
+  }
+
+  // a lost connection still has its memory and socket, and xlib knows not to
+  // talk to the server while closing it
+  if (display != NULL) {
+    XCloseDisplay(display);
+  }
+
+  close(clipboardWake_[0]);
+  clipboardWake_[0] = -1;
+}
+
+void RunMonitor() {
+  // the monitor connects on its own thread, so a slow server never holds up
+  // the js thread that started it
+  Display* display = OpenDisplay();
+  bool lost = display == NULL;
+  Atoms atoms;
+  if (display != NULL) {
+    XSetIOErrorExitHandler(display, OnIOError, &lost);
+    atoms = InternAtoms(display);
+  }
+
+  // the monitor lives across changes to what's being watched, so its
+  // selections are brought in line with the latest options whenever
+  // StartMonitor changes them
+  MonitorOptions applied;
+  int generation = -1;
+  int xinputOpcode = -1;
+
+  // mouse moves are reported at most once per interval, and a move during the
+  // interval is reported when it ends, so the last position is never dropped
+  long interval = 0;
+  timespec lastMove = {0, 0};
+  bool movePending = false;
+  while (true) {
+    MonitorOptions options;
+    bool changed = false;
+    {
+      std::lock_guard<std::mutex> lock(monitorMutex_);
+      options = monitorOptions_;
+      changed = monitorGeneration_ != generation;
+      generation = monitorGeneration_;
+    }
+
+    if (changed && !lost) {
+      if (options.windows != applied.windows) {
+        XSelectInput(display, XDefaultRootWindow(display),
+                     options.windows ? PropertyChangeMask : NoEventMask);
+      }
+
+      // every change asks again when the mouse can't be watched, so each
+      // caller hears about it
+      if (options.mouse && xinputOpcode == -1) {
+        xinputOpcode = SelectRawMotion(display, true);
+        if (xinputOpcode == -1) {
+          monitorCallback_(MonitorEvent::MouseUnavailable);
+        } else {
+          UpdateMouseLocation(display);
+        }
+      } else if (!options.mouse && xinputOpcode != -1) {
+        SelectRawMotion(display, false);
+        xinputOpcode = -1;
+        mouseLocationKnown_ = false;
+        movePending = false;
+      }
+
+      interval = std::max(options.mouseInterval, 0) * 1000L;
+      applied = options;
+      XFlush(display);
+    }
+
+    // once the connection is gone, nothing more will be reported, so say so
+    // right away rather than leaving the caller waiting. it's told once, and
+    // the next StartMonitor starts over with a new connection.
+    if (lost && !monitorLost_) {
+      mouseLocationKnown_ = false;
+      monitorLost_ = true;
+      monitorCallback_(MonitorEvent::Lost);
+    }
+
+    int timeout = -1;
+    if (movePending) {
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timeout = std::max(interval - Elapsed(lastMove, now), 0L) / 1000;
+    }
+
+    if (!lost && XPending(display) == 0) {
+      pollfd fds[2] = {{ConnectionNumber(display), POLLIN, 0},
+                       {monitorWake_[0], POLLIN, 0}};
+      poll(fds, 2, timeout);
+    } else if (lost) {
+      pollfd fds[1] = {{monitorWake_[0], POLLIN, 0}};
+      poll(fds, 1, -1);
+    }
+
+    // the other end of the pipe is only closed when we're being stopped
+    char buffer[64];
+    if (read(monitorWake_[0], buffer, sizeof(buffer)) == 0) {
+      break;
+    }
+
+    // a burst of changes (e.g., an application opening several windows) is
+    // only reported once
+    bool active = false;
+    bool running = false;
+    bool moved = false;
+    while (!lost && XPending(display) > 0) {
+      XEvent event;
+      XNextEvent(display, &event);
+      if (event.type == PropertyNotify) {
+        active = active || event.xproperty.atom == atoms.netActiveWindow;
+        running = running || event.xproperty.atom == atoms.netClientList;
+      } else if (event.type == GenericEvent &&
+                 event.xcookie.extension == xinputOpcode &&
+                 event.xcookie.evtype == XI_RawMotion) {
+        moved = true;
+      }
+    }
+
+    // raw motion only has the distance the device moved, not where the pointer
+    // ended up, so it's looked up once for every batch of moves
+    if (moved && !lost) {
+      UpdateMouseLocation(display);
+      movePending = true;
+    }
+
+    if (movePending && !lost) {
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (Elapsed(lastMove, now) >= interval) {
+        monitorCallback_(MonitorEvent::MouseMove);
+        lastMove = now;
+        movePending = false;
+      }
+    }
+
+    if (active && applied.windows) {
+      monitorCallback_(MonitorEvent::ActiveApplication);
+    }
+    if (running && applied.windows) {
+      monitorCallback_(MonitorEvent::RunningApplications);
+    }
+  }
+
+  mouseLocationKnown_ = false;
+  if (display != NULL) {
+    XCloseDisplay(display);
+  }
+
+  close(monitorWake_[0]);
+  monitorWake_[0] = -1;
+}
+
+int SelectRawMotion(Display* display, bool enabled) {
+  int opcode = -1;
+  int event = 0;
+  int error = 0;
+  int major = 2;
+  int minor = 2;
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (!XQueryExtension(display, "XInputExtension", &opcode, &event, &error)) {
+    return -1;
+  }
+
+  // before 2.1, raw events only go to the client with a grab while there is
+  // one, which includes the implicit grab while a button is held, so drags
+  // would go unreported
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (XIQueryVersion(display, &major, &minor) != Success ||
+      (major == 2 && minor < 1)) {
+    return -1;
+  }
+
+  // raw events are sent to the root window no matter which window the pointer
+  // is over, unlike regular motion events
+  unsigned char mask[XIMaskLen(XI_RawMotion)] = {0};
+  if (enabled) {
+    XISetMask(mask, XI_RawMotion);
+  }
+
+  XIEventMask eventMask = {XIAllMasterDevices, sizeof(mask), mask};
+  XISelectEvents(display, XDefaultRootWindow(display), &eventMask, 1);
+  return opcode;
+}
+
+size_t SelectionChunkSize(Display* display) {
+  // requests are limited in size (in units of 4 bytes), so leave some room for
+  // the rest of the ChangeProperty request
+  long size = XExtendedMaxRequestSize(display);
+  if (size == 0) {
+    size = XMaxRequestSize(display);
+  }
+
+  return std::min<size_t>(size * 4 - 64, 1 << 18);
+}
+
+TimingReport SendInputBatch(const std::vector<InputEvent>& events,
+                            bool serverTiming) {
+  timeline_.Reset();
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return timeline_.Report();
+  }
+
+  // keys are resolved as they're sent rather than up front, since a key
+  // without a keycode of its own takes over the least recently used spare one,
+  // which an earlier key in the batch could still be waiting to use. remapping
+  // syncs first, so everything sent with the old mapping is handled by then.
+  // releases use whatever the press resolved to, even if that's been remapped.
+  std::tuple<int, bool, bool> shift = GetKeycodeAndModifiers(display, "shift");
+  std::tuple<int, bool, bool> altgr = GetKeycodeAndModifiers(display, "altgr");
+  std::unordered_map<std::string, std::tuple<int, bool, bool>> held;
+
+  auto fakeKey = [display](int keycode, bool down) {
+    Span span("XTestFakeKeyEvent");
+    XTestFakeKeyEvent(display, keycode, down, CurrentTime);
+    PROBE2(key_toggle, keycode, down);
+  };
+
+  // held keys can share a keycode (e.g., shift for two capital letters, or a
+  // key that's shift itself), so it's only pressed for the first of them and
+  // released after the last. keys pressed before this batch aren't counted.
+  std::unordered_map<int, int> holders;
+  auto hold = [&](int keycode) {
+    if (keycode != -1 && holders[keycode]++ == 0) {
+      fakeKey(keycode, true);
+    }
+  };
+  auto release = [&](int keycode, bool counted) {
+    if (keycode == -1) {
+      return;
+    }
+
+    if (counted) {
+      holders[keycode]--;
+    }
+    if (holders[keycode] == 0) {
+      fakeKey(keycode, false);
+    }
+  };
+
+  // events are only buffered by xlib until the next flush, so the whole batch
+  // is sent at once, except when a wait needs everything before it delivered.
+  // with server timing, waits are instead sent as an empty pointer motion with
+  // an xtest delay, so the server does the waiting and nothing is flushed.
+  for (const InputEvent& event : events) {
+    std::tuple<int, bool, bool> keycode(-1, false, false);
+    switch (event.type) {
+      case InputEventType::KeyDown:
+        // a key that's already down stays down until it's released
+        if (held.count(event.key) > 0) {
+          break;
+        }
+
+        keycode = GetKeycodeAndModifiers(display, event.key);
+        if (std::get<0>(keycode) == -1) {
+          break;
+        }
+
+        held[event.key] = keycode;
+        if (std::get<1>(keycode)) {
+          hold(std::get<0>(shift));
+        }
+        if (std::get<2>(keycode)) {
+          hold(std::get<0>(altgr));
+        }
+
+        hold(std::get<0>(keycode));
+        break;
+      case InputEventType::KeyUp: {
+        bool counted = held.count(event.key) > 0;
+        if (counted) {
+          keycode = held[event.key];
+          held.erase(event.key);
+        } else {
+          keycode = GetKeycodeAndModifiers(display, event.key);
+        }
+
+        if (std::get<0>(keycode) == -1) {
+          break;
+        }
+
+        release(std::get<0>(keycode), counted);
+        if (std::get<2>(keycode)) {
+          release(std::get<0>(altgr), counted);
+        }
+        if (std::get<1>(keycode)) {
+          release(std::get<0>(shift), counted);
+        }
+        break;
+      }
+      case InputEventType::MouseDown: {
+        Span span("XTestFakeButtonEvent");
+        XTestFakeButtonEvent(display, GetMouseButton(event.button), true,
+                             CurrentTime);
+        PROBE2(button, GetMouseButton(event.button), true);
+        break;
+      }
+      case InputEventType::MouseUp: {
+        Span span("XTestFakeButtonEvent");
+        XTestFakeButtonEvent(display, GetMouseButton(event.button), false,
+                             CurrentTime);
+        PROBE2(button, GetMouseButton(event.button), false);
+        break;
+      }
+      case InputEventType::Move:
+        XTestFakeMotionEvent(display, -1, event.x, event.y, CurrentTime);
+        CacheMouseLocation(event.x, event.y);
+        break;
+      case InputEventType::Wait:
+        if (serverTiming) {
+          XTestFakeRelativeMotionEvent(display, 0, 0, event.delay);
+          timeline_.Advance(event.delay * 1000);
+        } else {
+          {
+            Span span("XFlush");
+            XFlush(display);
+            PROBE1(flush, 0);
+          }
+
+          timeline_.Wait(event.delay * 1000);
+        }
+        break;
+    }
+
+    // batches are only paced when asked to be, since they're otherwise sent
+    // without any delay between events
+    if (pacing_.mode == PacingMode::Sync &&
+        event.type != InputEventType::Wait) {
+      Pace(display, 0);
+    }
+  }
+
+  // wait for the server to handle everything, so the report includes any
+  // delays the server was asked to make
+  Span span("XSync");
+  XSync(display, False);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  PROBE1(flush, 1);
+  return timeline_.Report();
+}
+
+Time ServerTime(Display* display, Window window) {
+  // the server only says what time it is in events, so make one happen by
+  // appending nothing to a property
+  XSelectInput(display, window, PropertyChangeMask);
+  XChangeProperty(display, window, atoms_.xselData, XA_STRING, 8,
+                  PropModeAppend, NULL, 0);
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  timespec deadline = Deadline(kCopyTimeout);
+  XEvent event;
+  while (NextEvent(display, event, deadline)) {
+    if (event.type == PropertyNotify && event.xproperty.window == window) {
+      return event.xproperty.time;
+    }
+
+    ProcessEvent(display, event);
+  }
+
+  return CurrentTime;
+}
+
+bool SetClipboard(const std::string& text, bool owned) {
+  std::unique_lock<std::mutex> lock(clipboardMutex_);
+  if (clipboardLost_) {
+    // the owner has already given up by the time this is set, so joining it
+    // here doesn't wait on anything
+    clipboardThread_.join();
+    close(clipboardWake_[1]);
+    clipboardWake_[1] = -1;
+    clipboardLost_ = false;
+  }
+
+  if (!clipboardThread_.joinable()) {
+    if (pipe(clipboardWake_) != 0) {
+      return false;
+    }
+
+    fcntl(clipboardWake_[0], F_SETFL, O_NONBLOCK);
+    clipboardThread_ = std::thread(RunClipboardOwner);
+  }
+
+  // the selection owner has its own connection and thread, since it needs to
+  // answer requests for the clipboard while we're busy typing the paste chord
+  clipboardText_ = text;
+  clipboardOwned_ = owned;
+  int requested = ++clipboardRequested_;
+  if (write(clipboardWake_[1], "", 1) != 1) {
+    return false;
+  }
+
+  Span span("clipboard owner wait");
+  clipboardChanged_.wait_for(lock, std::chrono::seconds(1), [=] {
+    return clipboardApplied_ >= requested;
+  });
+
+  return clipboardApplied_ >= requested && clipboardOwned_ == owned;
+}
+
 void SetMouseLocation(int x, int y) {
-  Display* display = XOpenDisplay(NULL);
+  Display* display = GetDisplay();
+  if (display == NULL) {
+    return;
+  }
+
   XWarpPointer(display, None, XDefaultRootWindow(display), 0, 0, 0, 0, x, y);
-  XCloseDisplay(display);
+  XFlush(display);
+  CacheMouseLocation(x, y);
+}
+
+void SetPacing(const Pacing& pacing) {
+  timeline_.Reset();
+  pacing_ = pacing;
+  pacing_.syncInterval = std::max(pacing_.syncInterval, 1);
+  pacedEvents_ = 0;
+}
+
+void Shutdown() {
+  CloseAccessibility();
+  CloseDisplay();
+  StopClipboardOwner();
+}
+
+void StartMonitor(const MonitorOptions& options,
+                  std::function<void(MonitorEvent)> callback) {
+  {
+    std::lock_guard<std::mutex> lock(monitorMutex_);
+    monitorOptions_ = options;
+    monitorGeneration_++;
+  }
+
+  // a monitor that's still connected only needs to change what it selects,
+  // rather than reconnecting every time a listener is added or removed
+  if (monitorThread_.joinable() && !monitorLost_ &&
+      write(monitorWake_[1], "", 1) == 1) {
+    return;
+  }
+
+  StopMonitor();
+  if (pipe(monitorWake_) != 0) {
+    callback(MonitorEvent::Lost);
+    return;
+  }
+
+  // the monitor has its own connection, so that it can wait for changes
+  // without holding up (or being held up by) the worker thread
+  fcntl(monitorWake_[0], F_SETFL, O_NONBLOCK);
+  monitorCallback_ = callback;
+  monitorLost_ = false;
+  monitorThread_ = std::thread(RunMonitor);
+}
+
+void StopClipboardOwner() {
+  if (!clipboardThread_.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(clipboardMutex_);
+    close(clipboardWake_[1]);
+    clipboardWake_[1] = -1;
+    clipboardLost_ = false;
+  }
+
+  clipboardThread_.join();
+}
+
+void StopMonitor() {
+  if (!monitorThread_.joinable()) {
+    return;
+  }
+
+  close(monitorWake_[1]);
+  monitorWake_[1] = -1;
+  monitorThread_.join();
+}
+
+Timeline::Timeline() { Reset(); }
+
+long Timeline::Advance(long delay) {
+  intended_ += delay;
+  deadline_.tv_nsec += delay * 1000;
+  deadline_.tv_sec += deadline_.tv_nsec / 1000000000;
+  deadline_.tv_nsec %= 1000000000;
+
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long remaining = Elapsed(now, deadline_);
+  if (remaining >= 0) {
+    return remaining;
+  }
+
+  // if we've fallen more than a whole delay behind, start the schedule over
+  // from now, rather than sending everything we missed in a burst
+  maxLateness_ = std::max(maxLateness_, -remaining);
+  if (-remaining > delay) {
+    deadline_ = now;
+  }
+
+  return 0;
+}
+
+TimingReport Timeline::Report() const {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return TimingReport{intended_ / 1000.0, Elapsed(start_, now) / 1000.0,
+                      maxLateness_ / 1000.0};
+}
+
+void Timeline::Reset() {
+  clock_gettime(CLOCK_MONOTONIC, &start_);
+  deadline_ = start_;
+  intended_ = 0;
+  maxLateness_ = 0;
+}
+
+void Timeline::Wait(long delay) {
+  long remaining = Advance(delay);
+  if (remaining == 0) {
+    return;
+  }
+
+  Span span("sleep");
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline_, NULL) ==
+         EINTR) {
+  }
+
+  // the scheduler can wake us late when the system is busy
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  maxLateness_ = std::max(maxLateness_, Elapsed(deadline_, now));
+  sleepMicroseconds_.fetch_add(remaining + Elapsed(deadline_, now),
+                               std::memory_order_relaxed);
 }
 
 void ToggleKey(Display* display, const std::string& key, bool down) {
@@ -534,8 +2357,182 @@ void ToggleKey(Display* display, const std::string& key, bool down) {
     return;
   }
 
+  Span span("XTestFakeKeyEvent");
   XTestFakeKeyEvent(display, keycode, down, CurrentTime);
+  PROBE2(key_toggle, keycode, down);
   XFlush(display);
+  PROBE1(flush, 0);
+}
+
+bool TrackEditor(AtspiAccessible* accessible) {
+  if (editorAccessible_ != NULL) {
+    g_object_unref(editorAccessible_);
+    editorAccessible_ = NULL;
+  }
+
+  // whatever happened before can't be described as edits to this text, so
+  // callers that are behind have to start over from here
+  editorChanges_.clear();
+  editorVersion_++;
+  editorBaseVersion_ = editorVersion_;
+  editorStale_ = !ReadAccessibleText(accessible, editorText_, editorCaret_);
+  if (editorStale_) {
+    return false;
+  }
+
+  editorAccessible_ = (AtspiAccessible*)g_object_ref(accessible);
+  return true;
+}
+
+void UpdateMouseLocation(Display* display) {
+  Window root;
+  Window child;
+  int x = 0;
+  int y = 0;
+  int windowX = 0;
+  int windowY = 0;
+  unsigned int mask;
+  roundTrips_.fetch_add(1, std::memory_order_relaxed);
+  if (XQueryPointer(display, XDefaultRootWindow(display), &root, &child, &x,
+                    &y, &windowX, &windowY, &mask)) {
+    CacheMouseLocation(x, y);
+    mouseLocationKnown_.store(true, std::memory_order_relaxed);
+  }
+}
+
+void UpdateWindows(Display* display) {
+  if (!windowsStale_) {
+    return;
+  }
+
+  // only windows that are new to the client list (or whose process we couldn't
+  // find before) need their process looked up
+  windows_ = GetAllWindows(display);
+  std::unordered_map<Window, std::string> names;
+  std::vector<Window> lookups;
+  for (Window window : windows_) {
+    std::unordered_map<Window, std::string>::iterator cached =
+        windowNames_.find(window);
+    if (cached != windowNames_.end() && cached->second != "") {
+      names[window] = cached->second;
+      continue;
+    }
+
+    lookups.push_back(window);
+  }
+
+  std::vector<unsigned long> pids = GetWindowPids(display, lookups);
+  for (size_t i = 0; i < lookups.size(); i++) {
+    names[lookups[i]] = pids[i] == 0 ? "" : ProcessPath(pids[i]);
+  }
+
+  // names include the process's arguments, but only the executable is listed
+  windowNames_.swap(names);
+  runningApplications_.clear();
+  for (const std::pair<const Window, std::string>& name : windowNames_) {
+    runningApplications_.push_back(
+        name.second.substr(0, name.second.find('\0')));
+  }
+
+  // forget processes that have exited since the last time the list changed
+  for (std::unordered_map<unsigned long, std::pair<unsigned long long,
+                                                   std::string>>::iterator i =
+           processPaths_.begin();
+       i != processPaths_.end();) {
+    if (access((std::string("/proc/") + std::to_string(i->first)).c_str(),
+               F_OK) != 0) {
+      i = processPaths_.erase(i);
+    } else {
+      i++;
+    }
+  }
+
+  std::sort(runningApplications_.begin(), runningApplications_.end());
+  runningApplications_.erase(
+      std::unique(runningApplications_.begin(), runningApplications_.end()),
+      runningApplications_.end());
+  windowsStale_ = false;
+}
+
+long Utf16Offset(const std::string& text, long characters) {
+  long result = 0;
+  for (size_t i = 0; i < text.length() && characters > 0; i++) {
+    unsigned char c = text[i];
+    if ((c & 0xc0) == 0x80) {
+      continue;
+    }
+
+    // characters outside the basic multilingual plane are surrogate pairs
+    result += c >= 0xf0 ? 2 : 1;
+    characters--;
+  }
+
+  return result;
+}
+
+long Utf8Offset(const std::string& text, long characters) {
+  size_t i = 0;
+  while (characters > 0 && i < text.length()) {
+    i++;
+    while (i < text.length() && (text[i] & 0xc0) == 0x80) {
+      i++;
+    }
+
+    characters--;
+  }
+
+  // an offset past the end of the text
+  return characters > 0 ? -1 : (long)i;
+}
+
+bool Utf8ToLatin1(const std::string& text, std::string& result) {
+  result.clear();
+  for (size_t i = 0; i < text.length(); i++) {
+    unsigned char c = text[i];
+    if (c < 0x80) {
+      result += c;
+      continue;
+    }
+
+    // everything in latin-1 past ascii is two bytes in utf-8
+    if ((c & 0xe0) != 0xc0 || i + 1 >= text.length() ||
+        (text[i + 1] & 0xc0) != 0x80) {
+      return false;
+    }
+
+    long codepoint = ((c & 0x1f) << 6) | (text[i + 1] & 0x3f);
+    if (codepoint > 0xff) {
+      return false;
+    }
+
+    result += (char)codepoint;
+    i++;
+  }
+
+  return true;
+}
+
+bool WaitForOwner(
+    Display* display, Atom selection,
+    const std::function<bool(const XFixesSelectionNotifyEvent&)>& matches) {
+  // owner changes are recorded by ProcessEvent, so ones that were handled
+  // before we got here (e.g., while looking up keycodes) count too
+  timespec deadline = Deadline(kCopyTimeout);
+  while (true) {
+    for (const XFixesSelectionNotifyEvent& change : ownerChanges_) {
+      if (change.selection == selection && matches(change)) {
+        return true;
+      }
+    }
+
+    ownerChanges_.clear();
+    XEvent event;
+    if (!NextEvent(display, event, deadline)) {
+      return false;
+    }
+
+    ProcessEvent(display, event);
+  }
 }
 
 }  // namespace driver
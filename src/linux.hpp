@@ -1,33 +1,208 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/Xfixes.h>
+#include <atspi/atspi.h>
 
+#include <time.h>
+
+#include <functional>
 #include <string>
 #include <tuple>
 #include <vector>
 
+#include "input.hpp"
+
 namespace driver {
 
-void Click(Display* display, const std::string& button, int count);
+enum class MonitorEvent {
+  ActiveApplication,
+  RunningApplications,
+  MouseMove,
+  MouseUnavailable,
+  Lost
+};
+
+// which changes the monitor thread watches for. mouse moves are reported at
+// most once every mouseInterval milliseconds.
+struct MonitorOptions {
+  bool windows = false;
+  bool mouse = false;
+  int mouseInterval = 0;
+};
+
+// every atom used by the driver, which are interned once per connection
+struct Atoms {
+  Atom clipboard = None;
+  Atom incr = None;
+  Atom netActiveWindow = None;
+  Atom netClientList = None;
+  Atom netWmPid = None;
+  Atom targets = None;
+  Atom text = None;
+  Atom utf8String = None;
+  Atom xselData = None;
+};
+
+// a single edit to the tracked text field: the text from start to end, in
+// utf-16 code units as of just before the edit, was replaced with text
+struct EditorChange {
+  long start = 0;
+  long end = 0;
+  std::string text;
+};
+
+// what happened to the focused text field since a given version. when that
+// can't be described as edits (e.g., focus moved to another field, or the
+// version is too old), reset is set and text holds the entire contents.
+struct EditorDelta {
+  unsigned long version = 0;
+  int cursor = 0;
+  bool reset = false;
+  std::string text;
+  std::vector<EditorChange> changes;
+  bool error = true;
+};
+
+// a selection transfer that's too large for a single request, and is being
+// sent a chunk at a time using the INCR protocol
+struct Transfer {
+  Window requestor;
+  Atom property;
+  Atom type;
+  std::string data;
+  size_t offset;
+};
+
+// how closely a sequence of events kept to its schedule, in milliseconds: the
+// total of the delays that were asked for, how long the sequence actually took,
+// and the most that any single event was sent late
+struct TimingReport {
+  double intended;
+  double actual;
+  double maxLateness;
+};
+
+// a schedule of events at fixed offsets from when it started. waiting until an
+// absolute deadline, rather than sleeping for a delay, means that time spent
+// sending events doesn't accumulate over a long sequence.
+class Timeline {
+ public:
+  Timeline();
+
+  // move the deadline delay microseconds later, and return how far from now it
+  // is, without waiting for it
+  long Advance(long delay);
+  TimingReport Report() const;
+  void Reset();
+
+  // move the deadline delay microseconds later, and sleep until it
+  void Wait(long delay);
+
+ private:
+  timespec deadline_;
+  long intended_;
+  long maxLateness_;
+  timespec start_;
+};
+
+bool AccessibilityInitialized();
+void AnswerSelectionRequest(Display* display, const Atoms& atoms,
+                            XSelectionRequestEvent& request,
+                            const std::string& text,
+                            std::vector<Transfer>& transfers);
+void CacheMouseLocation(int x, int y);
+void Click(const std::string& button, int count);
+void CloseAccessibility();
+void CloseDisplay();
+long Codepoint(const std::string& s);
+void ContinueTransfer(Display* display, XPropertyEvent& event,
+                      std::vector<Transfer>& transfers);
+bool ConvertSelection(Display* display, Window window, Atom selection,
+                      Atom target, std::string& result, Atom& type,
+                      int& format);
+std::string CopySelection(Display* display, Window window);
+void CountTransfer(Display* display, Window requestor);
+timespec Deadline(int timeout);
+long Elapsed(const timespec& from, const timespec& to);
+AtspiAccessible* FindFocusedAccessible(AtspiAccessible* accessible,
+                                       int depth);
 void FocusApplication(const std::string& application);
 std::string GetActiveApplication();
 std::tuple<int, int, int, int> GetActiveApplicationWindowBounds();
 std::vector<Window> GetAllWindows(Display* display);
+std::tuple<int, int, bool> GetCachedMouseLocation();
 std::string GetClipboard(Display* display, Window window);
-std::tuple<std::string, int, bool> GetEditorState(Display* display);
-std::tuple<std::string, int, bool> GetEditorStateFallback(Display* display,
-                                                          bool paragraph);
+Display* GetDisplay();
+std::tuple<std::string, int, bool> GetEditorState();
+EditorDelta GetEditorStateDelta(unsigned long sinceVersion);
+std::tuple<std::string, int, bool> GetEditorStateFallback(bool paragraph,
+                                                          bool primary);
+AtspiAccessible* GetFocusedAccessible(Display* display);
 std::tuple<int, bool, bool> GetKeycodeAndModifiers(Display* display,
                                                    const std::string& key);
+int GetMouseButton(const std::string& button);
 std::tuple<int, int> GetMouseLocation();
-void GetProperty(Display* display, Window window, const std::string& property,
+void GetProperty(Display* display, Window window, Atom property,
                  unsigned char** result, unsigned long* length);
 std::vector<std::string> GetRunningApplications();
-void MouseDown(Display* display, const std::string& button);
-void MouseUp(Display* display, const std::string& button);
-void PressKey(Display* display, std::string key,
-              std::vector<std::string> modifiers);
+std::string GetSelection(Display* display, Window window, Atom selection);
+std::vector<unsigned long> GetWindowPids(Display* display,
+                                         const std::vector<Window>& windows);
+bool InitializeAccessibility();
+Atoms InternAtoms(Display* display);
+bool IsSpareKeycode(int keycode);
+std::string Latin1ToUtf8(const std::string& text);
+void LoadKeycodes(Display* display);
+void MouseDown(const std::string& button);
+void MouseUp(const std::string& button);
+bool NextEvent(Display* display, XEvent& event, const timespec& deadline);
+int OnError(Display* display, XErrorEvent* event);
+void OnFocusChanged(const AtspiEvent* event);
+void OnIOError(Display* display, void* data);
+void OnTextEvent(const AtspiEvent* event);
+Display* OpenDisplay();
+void Pace(Display* display, int delay);
+bool PasteText(const std::string& text);
+void PressKey(std::string key, std::vector<std::string> modifiers);
+void ProcessAccessibilityEvents();
+void ProcessEvent(Display* display, XEvent& event);
+void ProcessEvents(Display* display);
 std::string ProcessName(Display* display, Window window);
+std::string ProcessPath(unsigned long pid);
+unsigned long long ProcessStartTime(const std::string& stat);
+bool ReadAccessibleText(AtspiAccessible* accessible, std::string& text,
+                        int& caret);
+std::string ReadFile(const std::string& path);
+std::string ReadPrimary(Display* display, Window window,
+                        const std::string& key,
+                        const std::vector<std::string>& modifiers);
+void ReadProperty(Display* display, Window window, Atom property,
+                  std::string& result, Atom& type, int& format);
+int RemapKeycode(Display* display, KeySym keysym);
+void RunClipboardOwner();
+void RunMonitor();
+int SelectRawMotion(Display* display, bool enabled);
+size_t SelectionChunkSize(Display* display);
+TimingReport SendInputBatch(const std::vector<InputEvent>& events,
+                            bool serverTiming);
+Time ServerTime(Display* display, Window window);
+bool SetClipboard(const std::string& text, bool owned);
 void SetMouseLocation(int x, int y);
+void SetPacing(const Pacing& pacing);
+void Shutdown();
+void StartMonitor(const MonitorOptions& options,
+                  std::function<void(MonitorEvent)> callback);
+void StopClipboardOwner();
+void StopMonitor();
 void ToggleKey(Display* display, const std::string& key, bool down);
+bool TrackEditor(AtspiAccessible* accessible);
+void UpdateMouseLocation(Display* display);
+void UpdateWindows(Display* display);
+long Utf16Offset(const std::string& text, long characters);
+long Utf8Offset(const std::string& text, long characters);
+bool Utf8ToLatin1(const std::string& text, std::string& result);
+bool WaitForOwner(
+    Display* display, Atom selection,
+    const std::function<bool(const XFixesSelectionNotifyEvent&)>& matches);
 
 }  // namespace driver
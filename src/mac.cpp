@@ -4,12 +4,14 @@
 
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <tuple>
 #include <vector>
 
 #include "mac.hpp"
+#include "keys.hpp"
 
 namespace driver {
 
@@ -154,6 +156,68 @@ CFArrayRef CreateChildrenArray(AXUIElementRef element) {
   return children;
 }
 
+std::shared_ptr<const KeyboardLayout> CurrentKeyboardLayout() {
+  static std::shared_ptr<const KeyboardLayout> layout;
+  static std::string layoutId;
+
+  // the layout only needs to be read again when the user switches input sources
+  TISInputSourceRef currentKeyboard = TISCopyCurrentKeyboardInputSource();
+  CFStringRef idRef = static_cast<CFStringRef>(
+      TISGetInputSourceProperty(currentKeyboard, kTISPropertyInputSourceID));
+  std::string id = idRef == NULL ? "" : [static_cast<NSString*>(idRef) UTF8String];
+  if (layout && id == layoutId) {
+    CFRelease(currentKeyboard);
+    return layout;
+  }
+
+  std::shared_ptr<KeyboardLayout> result = std::make_shared<KeyboardLayout>();
+  CFDataRef layoutData = static_cast<CFDataRef>(
+      TISGetInputSourceProperty(currentKeyboard, kTISPropertyUnicodeKeyLayoutData));
+  if (layoutData != NULL) {
+    const UCKeyboardLayout* keyboardLayout =
+        reinterpret_cast<const UCKeyboardLayout*>(CFDataGetBytePtr(layoutData));
+
+    // characters that can be typed more than one way keep the first, so unshifted keys win
+    for (int shift = 0; shift < 2; shift++) {
+      for (int altgr = 0; altgr < 2; altgr++) {
+        for (int i = 0; i < 128; i++) {
+          UInt32 keysDown = 0;
+          UniChar chars[4];
+          UniCharCount realLength = 0;
+          UInt32 modifiers = 0;
+          if (shift == 1) {
+            modifiers |= shiftKey >> 8;
+          }
+          if (altgr == 1) {
+            modifiers |= optionKey >> 8;
+          }
+
+          UCKeyTranslate(keyboardLayout, CGKeyCode(i), kUCKeyActionDisplay, modifiers,
+                         LMGetKbdType(), kUCKeyTranslateNoDeadKeysBit, &keysDown,
+                         sizeof(chars) / sizeof(chars[0]), &realLength, chars);
+          if (realLength == 0) {
+            continue;
+          }
+
+          NSString* s =
+              static_cast<NSString*>(CFStringCreateWithCharacters(kCFAllocatorDefault, chars, 1));
+          const char* character = [s UTF8String];
+          if (character != NULL) {
+            result->keys.emplace(character, std::make_tuple(CGKeyCode(i), shift == 1, altgr == 1));
+          }
+
+          CFRelease(s);
+        }
+      }
+    }
+  }
+
+  CFRelease(currentKeyboard);
+  layout = result;
+  layoutId = id;
+  return layout;
+}
+
 CFStringRef GetLineText(AXUIElementRef element, CFMutableArrayRef textChildren) {
   if (element == NULL) {
     return NULL;
@@ -513,7 +577,8 @@ std::tuple<std::string, int, bool> GetEditorState() {
   return result;
 }
 
-std::tuple<std::string, int, bool> GetEditorStateFallback(bool paragraph) {
+std::tuple<std::string, int, bool> GetEditorStateFallback(const KeyboardLayout& layout,
+                                                          bool paragraph) {
   long delay = 30000;
   std::tuple<std::string, int, bool> result;
   std::get<2>(result) = true;
@@ -526,18 +591,18 @@ std::tuple<std::string, int, bool> GetEditorStateFallback(bool paragraph) {
   }
 
   if (paragraph) {
-    PressKey("up", std::vector<std::string>{"option", "shift"});
+    PressKey(layout, "up", std::vector<std::string>{"option", "shift"});
     usleep(delay);
   } else {
-    PressKey("left", std::vector<std::string>{"command", "shift"});
+    PressKey(layout, "left", std::vector<std::string>{"command", "shift"});
     usleep(delay);
-    PressKey("up", std::vector<std::string>{"command", "shift"});
+    PressKey(layout, "up", std::vector<std::string>{"command", "shift"});
     usleep(delay);
   }
 
-  PressKey("c", std::vector<std::string>{"command"});
+  PressKey(layout, "c", std::vector<std::string>{"command"});
   usleep(delay);
-  PressKey("right", std::vector<std::string>{});
+  PressKey(layout, "right", std::vector<std::string>{});
   usleep(delay);
 
   if (pasteboard.pasteboardItems.count == 0) {
@@ -546,18 +611,18 @@ std::tuple<std::string, int, bool> GetEditorStateFallback(bool paragraph) {
   NSString* left = [pasteboard.pasteboardItems[0] stringForType:NSPasteboardTypeString];
 
   if (paragraph) {
-    PressKey("down", std::vector<std::string>{"option", "shift"});
+    PressKey(layout, "down", std::vector<std::string>{"option", "shift"});
     usleep(delay);
   } else {
-    PressKey("right", std::vector<std::string>{"command", "shift"});
+    PressKey(layout, "right", std::vector<std::string>{"command", "shift"});
     usleep(delay);
-    PressKey("down", std::vector<std::string>{"command", "shift"});
+    PressKey(layout, "down", std::vector<std::string>{"command", "shift"});
     usleep(delay);
   }
 
-  PressKey("c", std::vector<std::string>{"command"});
+  PressKey(layout, "c", std::vector<std::string>{"command"});
   usleep(delay);
-  PressKey("left", std::vector<std::string>{});
+  PressKey(layout, "left", std::vector<std::string>{});
 
   if (pasteboard.pasteboardItems.count == 0) {
     return result;
@@ -671,122 +736,26 @@ std::string GetTitle(AXUIElementRef element) {
   return result;
 }
 
-std::tuple<CGKeyCode, bool, bool> GetVirtualKeyAndModifiers(const std::string& key) {
+std::tuple<CGKeyCode, bool, bool> GetVirtualKeyAndModifiers(const KeyboardLayout& layout,
+                                                            const std::string& key) {
   std::tuple<CGKeyCode, bool, bool> result;
   std::get<0>(result) = kVirtualKeyNotFound;
   if (key == "") {
     return result;
   }
 
-  if (key == "enter" || key == "\n" || key == "return") {
-    std::get<0>(result) = CGKeyCode(kVK_Return);
-  } else if (key == "tab" || key == "\t") {
-    std::get<0>(result) = CGKeyCode(kVK_Tab);
-  } else if (key == "space" || key == " ") {
-    std::get<0>(result) = CGKeyCode(kVK_Space);
-  } else if (key == "backspace" || key == "delete") {
-    std::get<0>(result) = CGKeyCode(kVK_Delete);
-  } else if (key == "forwarddelete") {
-    std::get<0>(result) = CGKeyCode(kVK_ForwardDelete);
-  } else if (key == "escape") {
-    std::get<0>(result) = CGKeyCode(kVK_Escape);
-  } else if (key == "command" || key == "cmd" || key == "commandOrControl") {
-    std::get<0>(result) = CGKeyCode(kVK_Command);
-  } else if (key == "caps") {
-    std::get<0>(result) = CGKeyCode(kVK_CapsLock);
-  } else if (key == "shift") {
-    std::get<0>(result) = CGKeyCode(kVK_Shift);
-  } else if (key == "option" || key == "alt") {
-    std::get<0>(result) = CGKeyCode(kVK_Option);
-  } else if (key == "control" || key == "ctrl") {
-    std::get<0>(result) = CGKeyCode(kVK_Control);
-  } else if (key == "function" || key == "fn") {
-    std::get<0>(result) = CGKeyCode(kVK_Function);
-  } else if (key == "home") {
-    std::get<0>(result) = CGKeyCode(kVK_Home);
-  } else if (key == "pageup") {
-    std::get<0>(result) = CGKeyCode(kVK_PageUp);
-  } else if (key == "end") {
-    std::get<0>(result) = CGKeyCode(kVK_End);
-  } else if (key == "pagedown") {
-    std::get<0>(result) = CGKeyCode(kVK_PageDown);
-  } else if (key == "left") {
-    std::get<0>(result) = CGKeyCode(kVK_LeftArrow);
-  } else if (key == "right") {
-    std::get<0>(result) = CGKeyCode(kVK_RightArrow);
-  } else if (key == "down") {
-    std::get<0>(result) = CGKeyCode(kVK_DownArrow);
-  } else if (key == "up") {
-    std::get<0>(result) = CGKeyCode(kVK_UpArrow);
-  } else if (key == "f1") {
-    std::get<0>(result) = CGKeyCode(kVK_F1);
-  } else if (key == "f2") {
-    std::get<0>(result) = CGKeyCode(kVK_F2);
-  } else if (key == "f3") {
-    std::get<0>(result) = CGKeyCode(kVK_F3);
-  } else if (key == "f4") {
-    std::get<0>(result) = CGKeyCode(kVK_F4);
-  } else if (key == "f5") {
-    std::get<0>(result) = CGKeyCode(kVK_F5);
-  } else if (key == "f6") {
-    std::get<0>(result) = CGKeyCode(kVK_F6);
-  } else if (key == "f7") {
-    std::get<0>(result) = CGKeyCode(kVK_F7);
-  } else if (key == "f8") {
-    std::get<0>(result) = CGKeyCode(kVK_F8);
-  } else if (key == "f9") {
-    std::get<0>(result) = CGKeyCode(kVK_F9);
-  } else if (key == "f10") {
-    std::get<0>(result) = CGKeyCode(kVK_F10);
-  } else if (key == "f11") {
-    std::get<0>(result) = CGKeyCode(kVK_F11);
-  } else if (key == "f12") {
-    std::get<0>(result) = CGKeyCode(kVK_F12);
+  const Key* named = FindKey(key);
+  if (named != NULL) {
+    std::get<0>(result) = CGKeyCode(named->code);
+    return result;
   }
 
-  TISInputSourceRef currentKeyboard = TISCopyCurrentKeyboardInputSource();
-  CFDataRef layoutData = static_cast<CFDataRef>(
-      TISGetInputSourceProperty(currentKeyboard, kTISPropertyUnicodeKeyLayoutData));
-  const UCKeyboardLayout* keyboardLayout =
-      reinterpret_cast<const UCKeyboardLayout*>(CFDataGetBytePtr(layoutData));
-
-  if (std::get<0>(result) == kVirtualKeyNotFound) {
-    for (int shift = 0; shift < 2; shift++) {
-      for (int altgr = 0; altgr < 2; altgr++) {
-        for (int i = 0; i < 128; i++) {
-          UInt32 keysDown = 0;
-          UniChar chars[4];
-          UniCharCount realLength;
-          UInt32 modifiers = 0;
-          if (shift == 1) {
-            modifiers |= shiftKey >> 8;
-          }
-          if (altgr == 1) {
-            modifiers |= optionKey >> 8;
-          }
-
-          UCKeyTranslate(keyboardLayout, CGKeyCode(i), kUCKeyActionDisplay, modifiers,
-                         LMGetKbdType(), kUCKeyTranslateNoDeadKeysBit, &keysDown,
-                         sizeof(chars) / sizeof(chars[0]), &realLength, chars);
-
-          NSString* s =
-              static_cast<NSString*>(CFStringCreateWithCharacters(kCFAllocatorDefault, chars, 1));
-          if (std::string([s UTF8String]) == key) {
-            std::get<0>(result) = CGKeyCode(i);
-            std::get<1>(result) = shift == 1;
-            std::get<2>(result) = altgr == 1;
-            CFRelease(s);
-            CFRelease(currentKeyboard);
-            return result;
-          }
-
-          CFRelease(s);
-        }
-      }
-    }
+  std::unordered_map<std::string, std::tuple<CGKeyCode, bool, bool>>::const_iterator keycode =
+      layout.keys.find(key);
+  if (keycode != layout.keys.end()) {
+    result = keycode->second;
   }
 
-  CFRelease(currentKeyboard);
   return result;
 }
 
@@ -829,9 +798,58 @@ void MouseUp(const std::string& button) {
   CFRelease(event);
 }
 
-void PressKey(const std::string& key, const std::vector<std::string>& modifiers) {
-  ToggleKey(key, modifiers, true);
-  ToggleKey(key, modifiers, false);
+void PressKey(const KeyboardLayout& layout, const std::string& key,
+              const std::vector<std::string>& modifiers) {
+  ToggleKey(layout, key, modifiers, true);
+  ToggleKey(layout, key, modifiers, false);
+}
+
+void SendInputBatch(const KeyboardLayout& layout, const std::vector<InputEvent>& events) {
+  // moves while a button is down are drags, which applications only handle as such when they're
+  // sent as the matching event type
+  bool left = CGEventSourceButtonState(kCGEventSourceStateCombinedSessionState, kCGMouseButtonLeft);
+  bool right =
+      CGEventSourceButtonState(kCGEventSourceStateCombinedSessionState, kCGMouseButtonRight);
+  for (const InputEvent& event : events) {
+    switch (event.type) {
+      case InputEventType::KeyDown:
+        ToggleKey(layout, event.key, std::vector<std::string>{}, true);
+        break;
+      case InputEventType::KeyUp:
+        ToggleKey(layout, event.key, std::vector<std::string>{}, false);
+        break;
+      case InputEventType::MouseDown:
+        MouseDown(event.button);
+        if (event.button == "left") {
+          left = true;
+        } else {
+          right = true;
+        }
+        break;
+      case InputEventType::MouseUp:
+        MouseUp(event.button);
+        if (event.button == "left") {
+          left = false;
+        } else {
+          right = false;
+        }
+        break;
+      case InputEventType::Move: {
+        CGEventType type = left    ? kCGEventLeftMouseDragged
+                           : right ? kCGEventRightMouseDragged
+                                   : kCGEventMouseMoved;
+        CGEventRef move = CGEventCreateMouseEvent(nil, type, CGPointMake(event.x, event.y),
+                                                  right && !left ? kCGMouseButtonRight
+                                                                 : kCGMouseButtonLeft);
+        CGEventPost(kCGHIDEventTap, move);
+        CFRelease(move);
+        break;
+      }
+      case InputEventType::Wait:
+        usleep(event.delay * 1000);
+        break;
+    }
+  }
 }
 
 void SetEditorState(const std::string& text, int cursor, int cursorEnd) {
@@ -876,9 +894,10 @@ void SetMouseLocation(int x, int y) {
   usleep(100000);
 }
 
-void ToggleKey(const std::string& key, const std::vector<std::string>& modifiers, bool down) {
+void ToggleKey(const KeyboardLayout& layout, const std::string& key,
+               const std::vector<std::string>& modifiers, bool down) {
   std::vector<std::string> adjustedModifiers = modifiers;
-  std::tuple<CGKeyCode, bool, bool> keycode = GetVirtualKeyAndModifiers(key);
+  std::tuple<CGKeyCode, bool, bool> keycode = GetVirtualKeyAndModifiers(layout, key);
   if (std::get<1>(keycode)) {
     adjustedModifiers.push_back("shift");
   }
@@ -890,55 +909,25 @@ void ToggleKey(const std::string& key, const std::vector<std::string>& modifiers
   CGEventRef event = CGEventCreateKeyboardEvent(source, std::get<0>(keycode), down);
 
   if (std::get<0>(keycode) == kVirtualKeyNotFound && key != "") {
-    unichar c[1];
-    c[0] = [[NSString stringWithFormat:@"%c", key[0]] characterAtIndex:0];
-    CGEventKeyboardSetUnicodeString(event, 1, c);
+    // characters outside of the BMP are two UTF-16 code units
+    NSString* characters = [NSString stringWithUTF8String:key.c_str()];
+    unichar c[2];
+    NSUInteger length = std::min(characters.length, (NSUInteger)2);
+    [characters getCharacters:c range:NSMakeRange(0, length)];
+    CGEventKeyboardSetUnicodeString(event, length, c);
   }
 
-  CGEventSetFlags(event, 0);
+  CGEventFlags flags = 0;
   if (down) {
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "shift") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskShift);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "control") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskControl);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "ctrl") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskControl);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "alt") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskAlternate);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "option") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskAlternate);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "command") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskCommand);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "cmd") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskCommand);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "commandOrControl") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskCommand);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "function") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskSecondaryFn);
-    }
-    if (std::find(adjustedModifiers.begin(), adjustedModifiers.end(), "fn") !=
-        adjustedModifiers.end()) {
-      CGEventSetFlags(event, CGEventGetFlags(event) | kCGEventFlagMaskSecondaryFn);
+    for (const std::string& modifier : adjustedModifiers) {
+      const Key* named = FindKey(modifier);
+      if (named != NULL) {
+        flags |= named->flags;
+      }
     }
   }
 
+  CGEventSetFlags(event, flags);
   CGEventPost(kCGHIDEventTap, event);
   CFRelease(source);
   CFRelease(event);
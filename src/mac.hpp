@@ -2,10 +2,14 @@
 #import <Carbon/Carbon.h>
 #import <Foundation/Foundation.h>
 
+#include <memory>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#include "input.hpp"
+
 #define kVirtualKeyNotFound 65535
 #define kAXOpenAction CFSTR("AXOpen")
 #define kAXEnhancedUserInterfaceAttribute CFSTR("AXEnhancedUserInterface")
@@ -13,6 +17,13 @@
 
 namespace driver {
 
+// the key, and whether shift and option are needed, for each character the keyboard layout can
+// type. the text input apis behind it have to be called on the main thread, so it's read there
+// before a call is queued, and the worker only ever looks things up in it.
+struct KeyboardLayout {
+  std::unordered_map<std::string, std::tuple<CGKeyCode, bool, bool>> keys;
+};
+
 bool ActiveApplicationIsSandboxed();
 void Click(const std::string& button, int count);
 bool ClickButton(AXUIElementRef element, const std::string& button, int count);
@@ -20,6 +31,7 @@ void ClickButton(const std::string& button, int count);
 AXUIElementRef CreateActiveTextFieldRef();
 AXUIElementRef CreateActiveWindowRef();
 CFArrayRef CreateChildrenArray(AXUIElementRef element);
+std::shared_ptr<const KeyboardLayout> CurrentKeyboardLayout();
 void Describe(AXUIElementRef element);
 void FocusApplication(const std::string& application);
 std::string GetActiveApplication();
@@ -30,7 +42,8 @@ void GetClickableButtons(AXUIElementRef element,
                          std::vector<std::string>& result);
 std::vector<std::string> GetClickableButtons();
 std::tuple<std::string, int, bool> GetEditorState();
-std::tuple<std::string, int, bool> GetEditorStateFallback(bool paragraph);
+std::tuple<std::string, int, bool> GetEditorStateFallback(
+    const KeyboardLayout& layout, bool paragraph);
 std::tuple<int, int> GetMouseLocation();
 CGPoint GetMousePoint();
 CFStringRef GetLines(AXUIElementRef element);
@@ -40,16 +53,18 @@ std::string GetRawTitle(AXUIElementRef element);
 std::vector<std::string> GetRunningApplications();
 std::string GetTitle(AXUIElementRef element);
 std::tuple<CGKeyCode, bool, bool> GetVirtualKeyAndModifiers(
-    const std::string& key);
+    const KeyboardLayout& layout, const std::string& key);
 bool HasActionName(AXUIElementRef element, CFStringRef name);
 bool IsButton(AXUIElementRef element);
 void MouseDown(const std::string& button);
 void MouseUp(const std::string& button);
-void PressKey(const std::string& key,
+void PressKey(const KeyboardLayout& layout, const std::string& key,
               const std::vector<std::string>& modifiers);
+void SendInputBatch(const KeyboardLayout& layout,
+                    const std::vector<InputEvent>& events);
 void SetEditorState(const std::string& text, int cursor, int cursorEnd);
 void SetMouseLocation(int x, int y);
-void ToggleKey(const std::string& key,
+void ToggleKey(const KeyboardLayout& layout, const std::string& key,
                const std::vector<std::string>& modifiers, bool down);
 void ToLower(std::string& s);
 
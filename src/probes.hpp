@@ -0,0 +1,33 @@
+// static tracepoints (usdt probes) under the serenade_driver provider, which bpftrace, perf, and
+// systemtap can attach to in a running process, e.g.:
+//
+//     bpftrace -e 'usdt:./build/Release/serenade-driver.node:serenade_driver:key_toggle
+//                  { printf("%d %d\n", arg0, arg1); }' -p <pid>
+//
+// a probe is a single nop until something attaches to it. without sys/sdt.h (e.g., systemtap's
+// headers aren't installed, or on other platforms), probes compile to nothing.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(serenade_driver, name)
+#define PROBE1(name, a) DTRACE_PROBE1(serenade_driver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(serenade_driver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(serenade_driver, name, a, b, c)
+#endif
+#endif
+
+#ifndef PROBE0
+#define PROBE0(name) \
+  do {               \
+  } while (0)
+#define PROBE1(name, a) \
+  do {                  \
+  } while (0)
+#define PROBE2(name, a, b) \
+  do {                     \
+  } while (0)
+#define PROBE3(name, a, b, c) \
+  do {                        \
+  } while (0)
+#endif
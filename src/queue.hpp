@@ -0,0 +1,58 @@
+#include <atomic>
+
+namespace driver {
+
+// an unbounded multi-producer, single-consumer queue. pushing is a single atomic exchange, so
+// producers never wait on each other or on the consumer, and items are popped in the order their
+// pushes completed.
+template <typename T>
+class Queue {
+ public:
+  Queue() : head_(new Node()), tail_(head_.load()) {}
+
+  ~Queue() {
+    T value;
+    while (Pop(value)) {
+    }
+
+    delete tail_;
+  }
+
+  Queue(const Queue&) = delete;
+  Queue& operator=(const Queue&) = delete;
+
+  // only safe to call from the consumer
+  bool Empty() const { return tail_->next.load(std::memory_order_acquire) == nullptr; }
+
+  // only safe to call from the consumer. returns false if the queue is empty, which includes the
+  // brief window where a producer has claimed its place in the queue but not yet linked it in.
+  bool Pop(T& value) {
+    Node* next = tail_->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+
+    value = next->value;
+    delete tail_;
+    tail_ = next;
+    return true;
+  }
+
+  void Push(const T& value) {
+    Node* node = new Node();
+    node->value = value;
+    Node* previous = head_.exchange(node, std::memory_order_acq_rel);
+    previous->next.store(node, std::memory_order_release);
+  }
+
+ private:
+  struct Node {
+    T value = T();
+    std::atomic<Node*> next{nullptr};
+  };
+
+  std::atomic<Node*> head_;
+  Node* tail_;
+};
+
+}  // namespace driver
@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace driver {
+
+// a latency histogram, in microseconds. values are grouped into 16 buckets for each power of two,
+// so every percentile is within about 6% of the true value, and recording is a few relaxed atomic
+// increments that can be made from any thread.
+class Histogram {
+ public:
+  Histogram() { Reset(); }
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+  double Mean() const {
+    uint64_t count = Count();
+    return count == 0 ? 0 : (double)sum_.load(std::memory_order_relaxed) / count;
+  }
+
+  // the highest value in the bucket that the given percentile (from 0 to 100) falls into
+  uint64_t Percentile(double percentile) const {
+    uint64_t count = Count();
+    uint64_t target = std::max<uint64_t>((uint64_t)(percentile / 100 * count + 0.5), 1);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets && count > 0; i++) {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen >= target) {
+        return std::min(Highest(i), Max());
+      }
+    }
+
+    return Max();
+  }
+
+  void Record(uint64_t value) {
+    buckets_[Index(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  void Reset() {
+    for (int i = 0; i < kBuckets; i++) {
+      buckets_[i].store(0, std::memory_order_relaxed);
+    }
+
+    count_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  // values below 16 get a bucket each, and anything past 2^40 microseconds (about 12 days) shares
+  // the last one
+  static constexpr int kMaxMagnitude = 40;
+  static constexpr int kBuckets = (kMaxMagnitude - 2) * 16;
+
+  static uint64_t Highest(int index) {
+    if (index < 16) {
+      return index;
+    }
+
+    int magnitude = index / 16 + 3;
+    uint64_t lowest = (uint64_t)(16 + index % 16) << (magnitude - 4);
+    return lowest + ((uint64_t)1 << (magnitude - 4)) - 1;
+  }
+
+  static int Index(uint64_t value) {
+    if (value < 16) {
+      return value;
+    }
+
+    int magnitude = 4;
+    while (magnitude <= kMaxMagnitude && value >> (magnitude + 1) != 0) {
+      magnitude++;
+    }
+
+    if (magnitude > kMaxMagnitude) {
+      return kBuckets - 1;
+    }
+
+    return (magnitude - 3) * 16 + ((value >> (magnitude - 4)) & 15);
+  }
+
+  std::atomic<uint64_t> buckets_[kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> max_;
+  std::atomic<uint64_t> sum_;
+};
+
+// every histogram and counter, by name. entries are created the first time they're used and never
+// removed, so references to them stay valid for the life of the process.
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms;
+  std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>> counters;
+};
+
+inline Registry& Stats() {
+  static Registry registry;
+  return registry;
+}
+
+// a counter of something that isn't a latency, like the number of round trips to the window
+// server, or the total time spent sleeping. like Stat, the lookup takes a lock, so callers should
+// look it up once and keep the reference.
+inline std::atomic<uint64_t>& Counter(const std::string& name) {
+  Registry& stats = Stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  std::unique_ptr<std::atomic<uint64_t>>& entry = stats.counters[name];
+  if (!entry) {
+    entry.reset(new std::atomic<uint64_t>(0));
+  }
+
+  return *entry;
+}
+
+inline std::vector<std::pair<std::string, uint64_t>> Counters() {
+  Registry& stats = Stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  std::vector<std::pair<std::string, uint64_t>> result;
+  for (const auto& entry : stats.counters) {
+    result.push_back(std::make_pair(entry.first, entry.second->load(std::memory_order_relaxed)));
+  }
+
+  return result;
+}
+
+inline void ResetStats() {
+  Registry& stats = Stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  for (auto& entry : stats.histograms) {
+    entry.second->Reset();
+  }
+
+  for (auto& entry : stats.counters) {
+    entry.second->store(0, std::memory_order_relaxed);
+  }
+}
+
+// the histogram with the given name. hot paths should look this up once and keep the reference,
+// since the lookup takes a lock.
+inline Histogram& Stat(const std::string& name) {
+  Registry& stats = Stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  std::unique_ptr<Histogram>& entry = stats.histograms[name];
+  if (!entry) {
+    entry.reset(new Histogram());
+  }
+
+  return *entry;
+}
+
+// calls fn with the name of every histogram and the histogram itself, in order of name
+template <typename Fn>
+void ForEachStat(Fn fn) {
+  Registry& stats = Stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  for (const auto& entry : stats.histograms) {
+    fn(entry.first, *entry.second);
+  }
+}
+
+// records how long it's been alive into a histogram
+class Timer {
+ public:
+  explicit Timer(Histogram& histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+  ~Timer() {
+    histogram_.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count());
+  }
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+
+ private:
+  Histogram& histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace driver
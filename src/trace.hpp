@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace driver {
+
+// a span of time on one thread, in microseconds since the trace started. names are always string
+// literals, so they're stored as pointers and don't need escaping.
+struct TraceEvent {
+  const char* name;
+  int64_t start;
+  int64_t duration;
+};
+
+// the most recent spans recorded by a single thread. only that thread writes to it, so recording
+// is a store and a release, with no locks or contention between threads. once it's full, the oldest
+// spans are overwritten.
+struct TraceBuffer {
+  static constexpr uint64_t kCapacity = 16384;
+
+  int thread = 0;
+  std::atomic<uint64_t> next{0};
+
+  // where the current trace starts. only the owning thread writes next, so rather than resetting
+  // it, starting a trace just remembers where it was.
+  uint64_t first = 0;
+  TraceEvent events[kCapacity];
+};
+
+// every thread's buffer. buffers are kept after their thread exits, so the spans it recorded still
+// show up in the trace.
+struct Tracer {
+  std::atomic<bool> enabled{false};
+  std::chrono::steady_clock::time_point start;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<TraceBuffer>> buffers;
+};
+
+inline Tracer& Tracing() {
+  static Tracer tracer;
+  return tracer;
+}
+
+inline TraceBuffer* ThreadTraceBuffer() {
+  // buffers are only created once a thread records a span, so threads that never do while tracing
+  // is on cost nothing
+  thread_local TraceBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    Tracer& tracer = Tracing();
+    std::lock_guard<std::mutex> lock(tracer.mutex);
+    tracer.buffers.emplace_back(new TraceBuffer());
+    buffer = tracer.buffers.back().get();
+    buffer->thread = tracer.buffers.size();
+  }
+
+  return buffer;
+}
+
+inline int64_t TraceTime(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(time - Tracing().start).count();
+}
+
+inline void StartTrace() {
+  Tracer& tracer = Tracing();
+  std::lock_guard<std::mutex> lock(tracer.mutex);
+  for (std::unique_ptr<TraceBuffer>& buffer : tracer.buffers) {
+    buffer->first = buffer->next.load(std::memory_order_acquire);
+  }
+
+  tracer.start = std::chrono::steady_clock::now();
+  tracer.enabled.store(true, std::memory_order_release);
+}
+
+// stop recording, and write everything that was recorded to path in the chrome trace event format,
+// which can be opened with chrome://tracing or https://ui.perfetto.dev
+inline bool StopTrace(const std::string& path) {
+  Tracer& tracer = Tracing();
+  tracer.enabled.store(false, std::memory_order_release);
+
+  std::ofstream file(path);
+  if (!file) {
+    return false;
+  }
+
+  file << "{\"traceEvents\":[";
+  bool first = true;
+  std::lock_guard<std::mutex> lock(tracer.mutex);
+  for (std::unique_ptr<TraceBuffer>& buffer : tracer.buffers) {
+    uint64_t next = buffer->next.load(std::memory_order_acquire);
+    uint64_t oldest = next > TraceBuffer::kCapacity ? next - TraceBuffer::kCapacity : 0;
+    for (uint64_t i = std::max(oldest, buffer->first); i < next; i++) {
+      const TraceEvent& event = buffer->events[i % TraceBuffer::kCapacity];
+      file << (first ? "" : ",") << "\n{\"name\":\"" << event.name
+           << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread << ",\"ts\":" << event.start
+           << ",\"dur\":" << event.duration << "}";
+      first = false;
+    }
+  }
+
+  file << "\n]}\n";
+  return file.good();
+}
+
+// records the time from when it's created to when it's destroyed, if tracing is on
+class Span {
+ public:
+  explicit Span(const char* name) : name_(name) {
+    if (Tracing().enabled.load(std::memory_order_acquire)) {
+      start_ = std::chrono::steady_clock::now();
+      recording_ = true;
+    }
+  }
+
+  ~Span() {
+    if (!recording_ || !Tracing().enabled.load(std::memory_order_relaxed)) {
+      return;
+    }
+
+    TraceBuffer* buffer = ThreadTraceBuffer();
+    uint64_t next = buffer->next.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[next % TraceBuffer::kCapacity];
+    event.name = name_;
+    event.start = TraceTime(start_);
+    event.duration =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                              start_)
+            .count();
+    buffer->next.store(next + 1, std::memory_order_release);
+  }
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+ private:
+  const char* name_;
+  std::chrono::steady_clock::time_point start_;
+  bool recording_ = false;
+};
+
+}  // namespace driver
@@ -13,6 +13,7 @@
 #include <tuple>
 #include <vector>
 
+#include "keys.hpp"
 #include "windows.hpp"
 #include "util.hpp"
 
@@ -270,70 +271,10 @@ std::tuple<int, bool, bool, int> GetVirtualKeyAndModifiers(
   std::tuple<int, bool, bool, int> result;
   std::get<0>(result) = -1;
 
-  if (key == "left") {
-    std::get<0>(result) = VK_LEFT;
-  } else if (key == "right") {
-    std::get<0>(result) = VK_RIGHT;
-  } else if (key == "up") {
-    std::get<0>(result) = VK_UP;
-  } else if (key == "down") {
-    std::get<0>(result) = VK_DOWN;
-  } else if (key == "control" || key == "ctrl" || key == "commandOrControl") {
-    std::get<0>(result) = VK_CONTROL;
-  } else if (key == "alt" || key == "option") {
-    std::get<0>(result) = VK_MENU;
-  } else if (key == "shift") {
-    std::get<0>(result) = VK_SHIFT;
-  } else if (key == "backspace") {
-    std::get<0>(result) = VK_BACK;
-  } else if (key == "delete") {
-    std::get<0>(result) = VK_DELETE;
-  } else if (key == "tab" || key == "\t") {
-    std::get<0>(result) = VK_TAB;
-  } else if (key == "space" || key == " ") {
-    std::get<0>(result) = VK_SPACE;
-  } else if (key == "caps") {
-    std::get<0>(result) = VK_CAPITAL;
-  } else if (key == "meta" || key == "win" || key == "windows") {
-    std::get<0>(result) = VK_LWIN;
-  } else if (key == "escape") {
-    std::get<0>(result) = VK_ESCAPE;
-  } else if (key == "enter" || key == "return" || key == "\n") {
-    std::get<0>(result) = VK_RETURN;
-  } else if (key == "pageup") {
-    std::get<0>(result) = VK_PRIOR;
-  } else if (key == "pagedown") {
-    std::get<0>(result) = VK_NEXT;
-  } else if (key == "home") {
-    std::get<0>(result) = VK_HOME;
-    std::get<3>(result) = 1;
-  } else if (key == "end") {
-    std::get<0>(result) = VK_END;
-    std::get<3>(result) = 1;
-  } else if (key == "f1") {
-    std::get<0>(result) = VK_F1;
-  } else if (key == "f2") {
-    std::get<0>(result) = VK_F2;
-  } else if (key == "f3") {
-    std::get<0>(result) = VK_F3;
-  } else if (key == "f4") {
-    std::get<0>(result) = VK_F4;
-  } else if (key == "f5") {
-    std::get<0>(result) = VK_F5;
-  } else if (key == "f6") {
-    std::get<0>(result) = VK_F6;
-  } else if (key == "f7") {
-    std::get<0>(result) = VK_F7;
-  } else if (key == "f8") {
-    std::get<0>(result) = VK_F8;
-  } else if (key == "f9") {
-    std::get<0>(result) = VK_F9;
-  } else if (key == "f10") {
-    std::get<0>(result) = VK_F10;
-  } else if (key == "f11") {
-    std::get<0>(result) = VK_F11;
-  } else if (key == "f12") {
-    std::get<0>(result) = VK_F12;
+  const Key* named = FindKey(key);
+  if (named != NULL) {
+    std::get<0>(result) = named->code;
+    std::get<3>(result) = static_cast<int>(named->flags);
   }
 
   // convert the key's character into a keyboard-indepdent virtual key
@@ -419,9 +360,40 @@ void RemoveNonASCII(std::string& s) {
   }
 }
 
+void SendInputBatch(const std::vector<InputEvent>& events) {
+  for (const InputEvent& event : events) {
+    switch (event.type) {
+      case InputEventType::KeyDown:
+        ToggleKey(event.key, true);
+        break;
+      case InputEventType::KeyUp:
+        ToggleKey(event.key, false);
+        break;
+      case InputEventType::MouseDown:
+        MouseDown(event.button);
+        break;
+      case InputEventType::MouseUp:
+        MouseUp(event.button);
+        break;
+      case InputEventType::Move:
+        SetCursorPos(event.x, event.y);
+        break;
+      case InputEventType::Wait:
+        Sleep(event.delay);
+        break;
+    }
+  }
+}
+
 void SetMouseLocation(int x, int y) { SetCursorPos(x, y); }
 
 void ToggleKey(const std::string& key, bool down) {
+  // characters that aren't ASCII can't be typed with a virtual key
+  if (key.length() > 1 && static_cast<unsigned char>(key[0]) >= 0x80) {
+    ToggleUnicodeKey(key, down);
+    return;
+  }
+
   // first, look for a hard-coded virtual key (e.g., for non-alphanumeric
   // characters)
   std::tuple<int, bool, bool, int> keycode = GetVirtualKeyAndModifiers(key);
@@ -450,4 +422,17 @@ void ToggleKey(const std::string& key, bool down) {
     ToggleKey("alt", false);
   }
 }
+
+void ToggleUnicodeKey(const std::string& key, bool down) {
+  wchar_t wide[2];
+  int length =
+      MultiByteToWideChar(CP_UTF8, 0, key.c_str(), key.length(), wide, 2);
+  for (int i = 0; i < length; i++) {
+    INPUT event = {};
+    event.type = INPUT_KEYBOARD;
+    event.ki.wScan = wide[i];
+    event.ki.dwFlags = KEYEVENTF_UNICODE | (down ? 0 : KEYEVENTF_KEYUP);
+    SendInput(1, &event, sizeof(INPUT));
+  }
+}
 }  // namespace driver
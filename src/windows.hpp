@@ -4,6 +4,8 @@
 #include <tuple>
 #include <vector>
 
+#include "input.hpp"
+
 namespace driver {
 
 void Click(const std::string& button, int count);
@@ -25,7 +27,9 @@ void MouseUp(const std::string& button);
 void PressKey(const std::string& key, std::vector<std::string> modifiers);
 std::string ProcessName(HWND window);
 void RemoveNonASCII(std::string& s);
+void SendInputBatch(const std::vector<InputEvent>& events);
 void SetMouseLocation(int x, int y);
 void ToggleKey(const std::string& key, bool down);
+void ToggleUnicodeKey(const std::string& key, bool down);
 
 }  // namespace driver
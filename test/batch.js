@@ -0,0 +1,40 @@
+const driver = require("../index");
+
+const run = async () => {
+  console.log('Typing "Hi!" with a single batch');
+  await driver.sendInputBatch([
+    { type: "keyDown", key: "H" },
+    { type: "keyUp", key: "H" },
+    { type: "keyDown", key: "i" },
+    { type: "keyUp", key: "i" },
+    { type: "keyDown", key: "!" },
+    { type: "keyUp", key: "!" },
+  ]);
+
+  console.log("Selecting the previous word");
+  await driver.sendInputBatch([
+    { type: "keyDown", key: "control" },
+    { type: "keyDown", key: "shift" },
+    { type: "keyDown", key: "left" },
+    { type: "keyUp", key: "left" },
+    { type: "keyUp", key: "shift" },
+    { type: "keyUp", key: "control" },
+  ]);
+
+  console.log("Dragging the mouse");
+  const timing = await driver.sendInputBatch([
+    { type: "move", x: 100, y: 100 },
+    { type: "mouseDown" },
+    { type: "wait", delay: 50 },
+    { type: "move", x: 300, y: 300 },
+    { type: "wait", delay: 50 },
+    { type: "mouseUp" },
+  ]);
+
+  if (timing) {
+    console.log(`Intended ${timing.intended}ms, took ${timing.actual}ms, at most ${timing.maxLateness}ms late`);
+  }
+};
+
+console.log("Sleeping for 3 seconds so you can focus another app like TextEdit ...");
+setTimeout(() => run(), 3000);
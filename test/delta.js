@@ -0,0 +1,26 @@
+const driver = require("../index");
+
+const run = async () => {
+  let text = "";
+  let version = 0;
+  setInterval(async () => {
+    const delta = await driver.getEditorStateDelta(version);
+    if (delta.error) {
+      return;
+    }
+
+    if (delta.reset) {
+      text = delta.text;
+    }
+
+    for (const change of delta.changes) {
+      text = text.substring(0, change.start) + change.text + text.substring(change.end);
+    }
+
+    version = delta.version;
+    console.log(delta);
+    console.log(text.substring(0, delta.cursor) + "<>" + text.substring(delta.cursor, text.length));
+  }, 500);
+};
+
+run();
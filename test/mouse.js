@@ -0,0 +1,8 @@
+const driver = require("../index");
+
+const stop = driver.onMouseMove((location) => {
+  console.log(location);
+}, 50);
+
+console.log("Move the mouse to see its location for the next 10 seconds ...");
+setTimeout(() => stop(), 10000);
@@ -0,0 +1,10 @@
+const driver = require("../index");
+
+const run = async () => {
+  const text = "The quick brown fox jumps over the lazy dog. ".repeat(50);
+  console.log(`Pasting ${text.length} characters`);
+  await driver.typeText(text, { paste: true });
+};
+
+console.log("Sleeping for 3 seconds so you can focus another app like gedit ...");
+setTimeout(() => run(), 3000);
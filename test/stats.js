@@ -0,0 +1,11 @@
+const driver = require("../index");
+
+const run = async () => {
+  await driver.resetStats();
+  await driver.typeText("hello world", { pacing: "sync" });
+  await driver.getActiveApplication();
+  await driver.getRunningApplications();
+  console.log(JSON.stringify(await driver.getStats(), null, 2));
+};
+
+run();
@@ -0,0 +1,12 @@
+const driver = require("../index");
+
+const run = async () => {
+  await driver.startTrace();
+  await driver.focusApplication("terminal");
+  await driver.typeText("hello world");
+  await driver.getEditorStateFallback();
+  const written = await driver.stopTrace("trace.json");
+  console.log(written ? "Wrote trace.json, which can be opened at https://ui.perfetto.dev" : "Failed");
+};
+
+run();
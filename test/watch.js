@@ -0,0 +1,11 @@
+const driver = require("../index");
+
+driver.onActiveApplicationChanged((application) => {
+  console.log("Active:", application);
+});
+
+driver.onRunningApplicationsChanged((applications) => {
+  console.log("Running:", applications);
+});
+
+console.log("Switch between or open applications to see changes ...");